@@ -0,0 +1,59 @@
+#include "doctest.h"
+
+#include "attrscache.h"
+#include "autotune.h"
+
+#include <cstdio>
+#include <fstream>
+
+BootAttrsCache::BootAttrsCache(const std::string &path) : path(path)
+{
+    std::ifstream file(path);
+    std::string key;
+    BootAttrs bootattrs;
+    while (file >> key >> bootattrs.version >> bootattrs.max_packet_length >> bootattrs.device_id >>
+           bootattrs.erase_size >> bootattrs.write_size >> bootattrs.memory_start >> bootattrs.memory_end >>
+           bootattrs.has_checksum)
+    {
+        entries[key] = bootattrs;
+    }
+}
+
+bool BootAttrsCache::get(const std::string &port, unsigned int device_id, BootAttrs &bootattrs) const
+{
+    std::map<std::string, BootAttrs>::const_iterator found = entries.find(ChunkSizeCache::key(port, device_id));
+    if (found == entries.end())
+        return false;
+    bootattrs = found->second;
+    return true;
+}
+
+void BootAttrsCache::put(const std::string &port, const BootAttrs &bootattrs)
+{
+    entries[ChunkSizeCache::key(port, bootattrs.device_id)] = bootattrs;
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary);
+        for (const std::pair<const std::string, BootAttrs> &entry : entries)
+        {
+            const BootAttrs &attrs = entry.second;
+            file << entry.first << " " << attrs.version << " " << attrs.max_packet_length << " " << attrs.device_id
+                 << " " << attrs.erase_size << " " << attrs.write_size << " " << attrs.memory_start << " "
+                 << attrs.memory_end << " " << attrs.has_checksum << "\n";
+        }
+        if (!file)
+        {
+            throw std::runtime_error("cannot write BootAttrs cache " + temporary);
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        throw std::runtime_error("cannot write BootAttrs cache " + path);
+    }
+}
+
+void BootAttrsCache::erase(const std::string &port, unsigned int device_id)
+{
+    entries.erase(ChunkSizeCache::key(port, device_id));
+}
@@ -0,0 +1,32 @@
+#ifndef ATTRSCACHE_H
+#define ATTRSCACHE_H
+
+#include "hexfile.h"
+
+#include <map>
+#include <string>
+
+/// @brief BootAttrs of the devices already seen on each port, kept in a small text file.
+// Used by `Bootloader::getBootAttrs(cache, port)` to skip GET_MEMORY_ADDRESS_RANGE and the CALC_CHECKSUM probe
+// when the same board is flashed again. One line per device : the key, then the BootAttrs fields.
+class BootAttrsCache
+{
+private:
+    std::string path;
+
+public:
+    std::map<std::string, BootAttrs> entries; // by ChunkSizeCache::key(port, device_id)
+
+    /// @brief reads `path` if it exists.
+    explicit BootAttrsCache(const std::string &path);
+
+    /// @brief copies the cached BootAttrs of `device_id` on `port` to `bootattrs`.
+    /// @return false if unknown.
+    bool get(const std::string &port, unsigned int device_id, BootAttrs &bootattrs) const;
+    /// @brief records the BootAttrs and rewrites the file.
+    void put(const std::string &port, const BootAttrs &bootattrs);
+    /// @brief forgets the device, after it answered READ_VERSION with other values than the cached ones.
+    void erase(const std::string &port, unsigned int device_id);
+};
+
+#endif /* ATTRSCACHE_H */
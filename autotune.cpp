@@ -0,0 +1,87 @@
+#include "doctest.h"
+
+#include "autotune.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+std::vector<Segment> splitChunks(const std::vector<Segment> &chunks, unsigned int chunk_bytes)
+{
+    std::vector<Segment> pieces;
+    for (const Segment &chunk : chunks)
+    {
+        for (size_t offset = 0; offset < chunk.data.size(); offset += chunk_bytes)
+        {
+            size_t size = std::min((size_t)chunk_bytes, chunk.data.size() - offset);
+            unsigned int address = chunk.minimum_address + offset;
+            pieces.push_back(Segment(address, address + size,
+                                     std::vector<uint8_t>(chunk.data.begin() + offset, chunk.data.begin() + offset + size),
+                                     chunk.word_size_bytes));
+        }
+    }
+    return pieces;
+}
+
+std::vector<unsigned int> chunkSizeCandidates(BootAttrs bootattrs)
+{
+    unsigned int largest = bootattrs.max_packet_length - Command::getSize();
+    largest -= largest % bootattrs.write_size;
+
+    std::vector<unsigned int> candidates;
+    for (unsigned int quarters = 4; quarters > 0; quarters--)
+    {
+        unsigned int size = largest * quarters / 4;
+        size -= size % bootattrs.write_size;
+        if (size >= (unsigned int)bootattrs.write_size &&
+            std::find(candidates.begin(), candidates.end(), size) == candidates.end())
+        {
+            candidates.push_back(size);
+        }
+    }
+    return candidates;
+}
+
+ChunkSizeCache::ChunkSizeCache(const std::string &path) : path(path)
+{
+    std::ifstream file(path);
+    std::string key;
+    unsigned int size;
+    while (file >> key >> size)
+    {
+        sizes[key] = size;
+    }
+}
+
+std::string ChunkSizeCache::key(const std::string &port, unsigned int device_id)
+{
+    return port + "#" + std::to_string(device_id);
+}
+
+unsigned int ChunkSizeCache::get(const std::string &key) const
+{
+    std::map<std::string, unsigned int>::const_iterator found = sizes.find(key);
+    return found == sizes.end() ? 0 : found->second;
+}
+
+void ChunkSizeCache::put(const std::string &key, unsigned int chunk_bytes)
+{
+    sizes[key] = chunk_bytes;
+
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary);
+        for (const std::pair<const std::string, unsigned int> &entry : sizes)
+        {
+            file << entry.first << " " << entry.second << "\n";
+        }
+        if (!file)
+        {
+            throw std::runtime_error("cannot write chunk size cache " + temporary);
+        }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        throw std::runtime_error("cannot write chunk size cache " + path);
+    }
+}
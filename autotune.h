@@ -0,0 +1,37 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "hexfile.h"
+
+#include <map>
+#include <string>
+
+/// @brief cuts every chunk in pieces of at most `chunk_bytes` bytes (a multiple of the write size).
+std::vector<Segment> splitChunks(const std::vector<Segment> &chunks, unsigned int chunk_bytes);
+
+/// @brief chunk sizes worth trying on a link : the largest the bootloader accepts, then 3/4, 1/2 and 1/4 of it,
+/// rounded down to the write size.
+std::vector<unsigned int> chunkSizeCandidates(BootAttrs bootattrs);
+
+/// @brief Best chunk size found for each device, kept in a small text file (one "key size" line per device).
+class ChunkSizeCache
+{
+private:
+    std::string path;
+
+public:
+    std::map<std::string, unsigned int> sizes;
+
+    /// @brief reads `path` if it exists.
+    explicit ChunkSizeCache(const std::string &path);
+
+    /// @brief the serial port and the device id : the adapter matters as much as the bootloader.
+    static std::string key(const std::string &port, unsigned int device_id);
+
+    /// @brief cached size for `key`, 0 if unknown.
+    unsigned int get(const std::string &key) const;
+    /// @brief records the size and rewrites the file.
+    void put(const std::string &key, unsigned int chunk_bytes);
+};
+
+#endif /* AUTOTUNE_H */
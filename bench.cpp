@@ -0,0 +1,157 @@
+#include "doctest.h"
+
+#include "bench.h"
+
+#include <algorithm>
+#include <chrono>
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+LatencyStats LatencyStats::of(std::vector<double> samples_ms)
+{
+    LatencyStats stats = {(unsigned int)samples_ms.size(), 0, 0, 0, 0, 0, 0};
+    if (samples_ms.empty())
+        return stats;
+    std::sort(samples_ms.begin(), samples_ms.end());
+    double total = 0;
+    for (double sample : samples_ms)
+        total += sample;
+    size_t last = samples_ms.size() - 1;
+    stats.min_ms = samples_ms.front();
+    stats.mean_ms = total / samples_ms.size();
+    stats.median_ms = samples_ms[last / 2];
+    stats.p90_ms = samples_ms[last * 90 / 100];
+    stats.p99_ms = samples_ms[last * 99 / 100];
+    stats.max_ms = samples_ms.back();
+    return stats;
+}
+
+double LinkReport::predictFlashSeconds(const std::vector<Segment> &chunks, BootAttrs bootattrs) const
+{
+    double ms = erase_ms_per_page * ((bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size);
+    for (const Segment &chunk : chunks)
+    {
+        ms += chunk.data.size() * 1000.0 / write_bytes_per_s;
+        if (bootattrs.has_checksum)
+            ms += checksum.mean_ms;
+    }
+    ms += ping.mean_ms; // SELF_VERIFY
+    return ms / 1000.0;
+}
+
+LinkBenchmark::LinkBenchmark(Bootloader &bootloader, BootAttrs bootattrs)
+    : bootloader(bootloader), bootattrs(bootattrs), pings(100), packets(32)
+{
+}
+
+LatencyStats LinkBenchmark::ping()
+{
+    std::vector<double> samples;
+    for (unsigned int i = 0; i < pings; i++)
+    {
+        Clock::time_point start = Clock::now();
+        bootloader.readVersion();
+        samples.push_back(elapsedMs(start));
+    }
+    return LatencyStats::of(samples);
+}
+
+LatencyStats LinkBenchmark::checksum()
+{
+    std::vector<double> samples;
+    if (!bootattrs.has_checksum)
+        return LatencyStats::of(samples);
+    for (unsigned int i = 0; i < pings; i++)
+    {
+        Clock::time_point start = Clock::now();
+        bootloader.calcChecksum(bootattrs.memory_start, bootattrs.write_size);
+        samples.push_back(elapsedMs(start));
+    }
+    return LatencyStats::of(samples);
+}
+
+double LinkBenchmark::readBandwidth()
+{
+    unsigned int packet_bytes = bootattrs.max_packet_length - Response::getSize();
+    packet_bytes -= packet_bytes % std::max(bootattrs.write_size, 4);
+    unsigned int memory_bytes = (bootattrs.memory_end - bootattrs.memory_start) * 2;
+    std::vector<uint8_t> data(packet_bytes);
+
+    Clock::time_point start = Clock::now();
+    unsigned int offset = 0;
+    for (unsigned int i = 0; i < packets; i++)
+    {
+        if (offset + packet_bytes > memory_bytes)
+            offset = 0;
+        bootloader.readFlash(bootattrs.memory_start + offset / 2, packet_bytes, data.data(), packet_bytes);
+        offset += packet_bytes;
+    }
+    return packets * packet_bytes * 1000.0 / std::max(elapsedMs(start), 1e-3);
+}
+
+double LinkBenchmark::writeBandwidth(unsigned int scratch_address, double &erase_ms_per_page)
+{
+    if (scratch_address % bootattrs.erase_size != 0 || scratch_address < (unsigned int)bootattrs.memory_start ||
+        scratch_address + bootattrs.erase_size > (unsigned int)bootattrs.memory_end)
+    {
+        throw std::invalid_argument("the scratch page must be a page of program memory");
+    }
+
+    unsigned int packet_bytes = bootattrs.max_packet_length - Command::getSize();
+    packet_bytes -= packet_bytes % bootattrs.write_size;
+    unsigned int page_bytes = bootattrs.erase_size * 2;
+    // with small pages, a packet holds no more than the scratch page
+    packet_bytes = std::min(packet_bytes, page_bytes);
+    unsigned int per_page = page_bytes / packet_bytes;
+
+    // a pattern with every bit cleared somewhere, the phantom bytes left at 0
+    std::vector<uint8_t> data(packet_bytes);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = (i % 4 == 3) ? 0 : (uint8_t)(0xA5 ^ i);
+
+    std::vector<double> erases;
+    double write_ms = 0;
+    unsigned int written = 0;
+    unsigned int slot = per_page; // start with an erase
+    for (unsigned int i = 0; i < packets; i++)
+    {
+        if (slot == per_page)
+        {
+            Clock::time_point start = Clock::now();
+            bootloader.eraseFlash(scratch_address, 1);
+            erases.push_back(elapsedMs(start));
+            slot = 0;
+        }
+        unsigned int address = scratch_address * 2 + slot * packet_bytes;
+        Segment chunk(address, address + packet_bytes, data, 2);
+        Clock::time_point start = Clock::now();
+        bootloader.writeFlash(chunk);
+        write_ms += elapsedMs(start);
+        written += packet_bytes;
+        slot++;
+    }
+
+    Clock::time_point start = Clock::now();
+    bootloader.eraseFlash(scratch_address, 1);
+    erases.push_back(elapsedMs(start));
+
+    erase_ms_per_page = LatencyStats::of(erases).mean_ms;
+    return written * 1000.0 / std::max(write_ms, 1e-3);
+}
+
+LinkReport LinkBenchmark::run(unsigned int scratch_address)
+{
+    LinkReport report;
+    report.ping = ping();
+    report.checksum = checksum();
+    report.read_bytes_per_s = readBandwidth();
+    report.write_bytes_per_s = writeBandwidth(scratch_address, report.erase_ms_per_page);
+    report.packet_bytes = bootattrs.max_packet_length - Command::getSize();
+    report.packet_bytes -= report.packet_bytes % bootattrs.write_size;
+    return report;
+}
@@ -0,0 +1,61 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "bootloader.h"
+
+/// @brief Distribution of a set of round trip times, in milliseconds.
+struct LatencyStats
+{
+    unsigned int samples;
+    double min_ms;
+    double mean_ms;
+    double median_ms;
+    double p90_ms;
+    double p99_ms;
+    double max_ms;
+
+    static LatencyStats of(std::vector<double> samples_ms);
+};
+
+/// @brief What `LinkBenchmark::run` measured on one link (adapter, cable and bootloader).
+struct LinkReport
+{
+    LatencyStats ping;           // READ_VERSION round trips
+    LatencyStats checksum;       // CALC_CHECKSUM of one write block
+    double read_bytes_per_s;     // READ_FLASH packets of the largest size, stop and wait
+    double write_bytes_per_s;    // WRITE_FLASH packets of the largest size, stop and wait
+    double erase_ms_per_page;    // ERASE_FLASH of one page
+    unsigned int packet_bytes;   // payload of the largest packets
+
+    /// @brief predicted duration of `Flasher::flash(chunks)` on this link, in seconds.
+    // Full erase, then for each chunk its write (at the measured bandwidth) and, if supported, its
+    // checksum round trip, then SELF_VERIFY.
+    double predictFlashSeconds(const std::vector<Segment> &chunks, BootAttrs bootattrs) const;
+};
+
+/// @brief Characterizes a link with the bootloader, to spot bad USB-serial adapters and choose chunk settings.
+// The write bandwidth is measured on a scratch page, which is erased, written, and left erased : the
+// application there is lost, choose a page it does not use (or flash it again afterwards).
+class LinkBenchmark
+{
+private:
+    Bootloader &bootloader;
+    BootAttrs bootattrs;
+
+public:
+    unsigned int pings;   // READ_VERSION (and CALC_CHECKSUM) round trips to time
+    unsigned int packets; // READ_FLASH and WRITE_FLASH packets to time
+
+    LinkBenchmark(Bootloader &bootloader, BootAttrs bootattrs);
+
+    LatencyStats ping();
+    LatencyStats checksum();
+    double readBandwidth();
+    /// @brief also measures the erase time of one page, in `erase_ms_per_page`.
+    double writeBandwidth(unsigned int scratch_address, double &erase_ms_per_page);
+
+    /// @brief runs every measurement, `scratch_address` is the word address of the scratch page.
+    LinkReport run(unsigned int scratch_address);
+};
+
+#endif /* BENCH_H */
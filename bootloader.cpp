@@ -0,0 +1,327 @@
+#include "doctest.h"
+
+#include "bootloader.h"
+
+#include <cmath>
+
+unsigned int localChecksum(const uint8_t *data, size_t size)
+{
+    unsigned int checksum = 0;
+    for (size_t i = 0; i + 3 <= size; i += 4)
+    {
+        checksum += data[i] + (data[i + 1] << 8) + data[i + 2];
+    }
+    return checksum;
+}
+
+unsigned int localChecksum(const std::vector<uint8_t> &data)
+{
+    return localChecksum(data.data(), data.size());
+}
+
+unsigned int erasedChecksum(size_t size)
+{
+    return (unsigned int)(size / 4) * (0xFFFF + 0xFF);
+}
+
+void fillErased(uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = (i % 4 == 3) ? 0x00 : 0xFF;
+    }
+}
+
+RttEstimator::RttEstimator() : srtt_ms(0), rttvar_ms(0), samples(0), backoff(1)
+{
+}
+
+void RttEstimator::sample(double rtt_ms)
+{
+    if (samples == 0)
+    {
+        srtt_ms = rtt_ms;
+        rttvar_ms = rtt_ms / 2;
+    }
+    else
+    {
+        rttvar_ms = 0.75 * rttvar_ms + 0.25 * std::abs(srtt_ms - rtt_ms);
+        srtt_ms = 0.875 * srtt_ms + 0.125 * rtt_ms;
+    }
+    samples++;
+    backoff = 1;
+}
+
+void RttEstimator::timedOut()
+{
+    if (backoff < 64)
+        backoff *= 2;
+}
+
+int RttEstimator::timeout(int initial_ms) const
+{
+    if (samples == 0)
+        return std::min(initial_ms * (int)backoff, BOOTLOADER_MAX_TIMEOUT_MS);
+    double timeout_ms = std::max(srtt_ms + 4 * rttvar_ms, (double)BOOTLOADER_MIN_TIMEOUT_MS) * backoff;
+    return (int)std::min(timeout_ms, (double)BOOTLOADER_MAX_TIMEOUT_MS);
+}
+
+Bootloader::Bootloader(Connection &connection)
+    : connection(connection), framed(0), scratch(4096), timeout_ms(BOOTLOADER_DEFAULT_TIMEOUT_MS), round_trips(0),
+      adaptive_timeouts(true)
+{
+}
+
+void Bootloader::send(const Command &command, const uint8_t *data, size_t size)
+{
+    // the payload is sent from where it is, only the header is encoded
+    std::array<uint8_t, 11> header = command.toBytes();
+    struct iovec parts[2] = {{header.data(), header.size()}, {const_cast<uint8_t *>(data), size}};
+    connection.writev(parts, size > 0 ? 2 : 1);
+    track(command);
+}
+
+/// @brief `command` was sent, its response is expected after the ones of the commands before it.
+void Bootloader::track(const Command &command)
+{
+    if (outstanding.empty())
+        sent_at = Clock::now();
+    outstanding.push_back(command);
+    round_trips++;
+}
+
+/// @brief ERASE_FLASH is measured per page, the other commands as a whole.
+static unsigned int rttUnits(const Command &command)
+{
+    if (command.getCommand() == CommandCode::ERASE_FLASH)
+        return std::max(command.getDataLength(), (uint16_t)1);
+    return 1;
+}
+
+int Bootloader::timeoutFor(const Command &command) const
+{
+    if (!adaptive_timeouts || command.getCommand() >= sizeof(rtt) / sizeof(rtt[0]))
+        return timeout_ms;
+    const RttEstimator &estimator = rtt[command.getCommand()];
+    if (estimator.samples == 0)
+        return estimator.timeout(timeout_ms);
+    return std::min(estimator.timeout(timeout_ms) * (int)rttUnits(command), BOOTLOADER_MAX_TIMEOUT_MS);
+}
+
+/// @brief waits for the response to the oldest outstanding command, and returns it (valid until the next one).
+// Throws BootloaderError if its status is not SUCCESS.
+const uint8_t *Bootloader::receiveResponse()
+{
+    framer.consume(framed);
+    framed = 0;
+    if (outstanding.empty())
+    {
+        throw std::logic_error("no command is waiting for a response");
+    }
+    const Command request = outstanding.front();
+    int timeout = timeoutFor(request);
+
+    while (true)
+    {
+        size_t skipped = framer.skipped;
+        framed = framer.frame(request);
+        if (framed > 0)
+            break;
+
+        if (framer.skipped != skipped)
+        {
+            // resynchronizing : whatever already arrived is taken in one go, without waiting
+            size_t n = connection.read(scratch.data(), scratch.size(), 0);
+            framer.feed(scratch.data(), n);
+            if (n > 0)
+                continue;
+        }
+
+        size_t missing = framer.missing(request);
+        if (scratch.size() < missing)
+            scratch.resize(missing);
+        size_t n = connection.read(scratch.data(), missing, timeout);
+        framer.feed(scratch.data(), n);
+        if (n < missing)
+        {
+            if (request.getCommand() < sizeof(rtt) / sizeof(rtt[0]))
+                rtt[request.getCommand()].timedOut();
+            // answers to the other commands, if they come, will not match the next requests and will be skipped
+            outstanding.clear();
+            throw BootloaderError("timeout while waiting for the bootloader", ResponseCode::UNSUPPORTED_COMMAND);
+        }
+    }
+
+    // only a command answered alone gives its round trip time
+    if (outstanding.size() == 1 && request.getCommand() < sizeof(rtt) / sizeof(rtt[0]))
+    {
+        double elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - sent_at).count();
+        rtt[request.getCommand()].sample(elapsed_ms / rttUnits(request));
+    }
+    outstanding.pop_front();
+
+    const uint8_t *response = framer.data();
+    uint8_t status = response[Command::getSize()];
+    if (request.getCommand() != CommandCode::READ_VERSION && status != ResponseCode::SUCCESS)
+    {
+        std::stringstream ss;
+        ss << "command 0x" << std::hex << (int)request.getCommand()
+           << " at address 0x" << request.getAddress() << " failed with response code 0x" << (int)status;
+        throw BootloaderError(ss.str(), static_cast<ResponseCode>(status));
+    }
+    return response;
+}
+
+Version Bootloader::readVersion()
+{
+    send(Command(CommandCode::READ_VERSION));
+    const uint8_t *response = receiveResponse();
+    std::array<uint8_t, 37> buffer;
+    std::copy(response, response + buffer.size(), buffer.begin());
+    Version version(0);
+    version.fromBytes(buffer);
+    return version;
+}
+
+MemoryRange Bootloader::getMemoryAddressRange()
+{
+    Command command(CommandCode::GET_MEMORY_ADDRESS_RANGE);
+    send(command);
+    const uint8_t *range = receiveResponse() + Response::getSize();
+    uint32_t program_start;
+    uint32_t program_end;
+    memcpy(&program_start, range, sizeof(program_start));
+    memcpy(&program_end, range + sizeof(program_start), sizeof(program_end));
+    return MemoryRange(command.getCommand(), program_start, program_end,
+                       command.getDataLength(), command.getUnlockSequence(), command.getAddress(),
+                       ResponseCode::SUCCESS);
+}
+
+/// @brief Same handshake as mcbootflash : version, memory range, then probe for CALC_CHECKSUM support.
+BootAttrs Bootloader::getBootAttrs()
+{
+    return getBootAttrs(readVersion());
+}
+
+/// @brief the rest of the handshake, once the device answered READ_VERSION with `version`.
+BootAttrs Bootloader::getBootAttrs(const Version &version)
+{
+    MemoryRange range = getMemoryAddressRange();
+
+    BootAttrs bootattrs;
+    bootattrs.version = version.getVersion();
+    bootattrs.max_packet_length = version.getMaxPacketLength();
+    bootattrs.device_id = version.getDeviceId();
+    bootattrs.erase_size = version.getEraseSize();
+    bootattrs.write_size = version.getWriteSize();
+    bootattrs.memory_start = range.getProgramStart();
+    // program_end is the last address of the last instruction, which takes two words
+    bootattrs.memory_end = range.getProgramEnd() + 2;
+
+    try
+    {
+        calcChecksum(bootattrs.memory_start, bootattrs.write_size);
+        bootattrs.has_checksum = true;
+    }
+    catch (const BootloaderError &error)
+    {
+        if (error.code != ResponseCode::UNSUPPORTED_COMMAND)
+            throw;
+        bootattrs.has_checksum = false;
+    }
+    return bootattrs;
+}
+
+BootAttrs Bootloader::getBootAttrs(BootAttrsCache &cache, const std::string &port)
+{
+    Version version = readVersion();
+    BootAttrs bootattrs;
+    if (cache.get(port, version.getDeviceId(), bootattrs))
+    {
+        if (bootattrs.version == version.getVersion() && bootattrs.max_packet_length == version.getMaxPacketLength() &&
+            bootattrs.erase_size == version.getEraseSize() && bootattrs.write_size == version.getWriteSize())
+            return bootattrs;
+        cache.erase(port, version.getDeviceId());
+    }
+    bootattrs = getBootAttrs(version);
+    cache.put(port, bootattrs);
+    return bootattrs;
+}
+
+/// @brief erases `pages` erase pages, starting at word address `address`.
+void Bootloader::eraseFlash(unsigned int address, unsigned int pages)
+{
+    send(Command(CommandCode::ERASE_FLASH, pages, BOOTLOADER_UNLOCK_SEQUENCE, address));
+    receiveResponse();
+}
+
+void Bootloader::readFlash(unsigned int address, unsigned int length, uint8_t *out, unsigned int packet_bytes, unsigned int window)
+{
+    packet_bytes -= packet_bytes % 4;
+    if (packet_bytes == 0 || window == 0)
+    {
+        throw std::invalid_argument("READ_FLASH packets must hold at least one instruction");
+    }
+
+    unsigned int requested = 0; // bytes asked so far
+    unsigned int received = 0;  // bytes read back so far
+    while (received < length)
+    {
+        while (outstanding.size() < window && requested < length)
+        {
+            unsigned int size = std::min(packet_bytes, length - requested);
+            send(Command(CommandCode::READ_FLASH, size, 0, address + requested / 2));
+            requested += size;
+        }
+        // the framer only accepts the response to the oldest request, so they come back in order
+        unsigned int size = outstanding.front().getDataLength();
+        const uint8_t *data = receiveResponse() + Response::getSize();
+        std::copy(data, data + size, out + received);
+        received += size;
+    }
+}
+
+void Bootloader::writeFlash(const Segment &chunk)
+{
+    send(Command(CommandCode::WRITE_FLASH, chunk.data.size(), BOOTLOADER_UNLOCK_SEQUENCE, chunk.address()),
+         chunk.data.data(), chunk.data.size());
+    receiveResponse();
+}
+
+/// @brief checksum of `length` bytes of program memory starting at word address `address`.
+uint16_t Bootloader::calcChecksum(unsigned int address, unsigned int length)
+{
+    send(Command(CommandCode::CALC_CHECKSUM, length, 0, address));
+    const uint8_t *response = receiveResponse();
+    uint16_t checksum;
+    memcpy(&checksum, response + Response::getSize(), sizeof(checksum));
+    return checksum;
+}
+
+void Bootloader::selfVerify()
+{
+    send(Command(CommandCode::SELF_VERIFY));
+    receiveResponse();
+}
+
+void Bootloader::reset()
+{
+    send(Command(CommandCode::RESET_DEVICE));
+    receiveResponse();
+}
+
+const uint8_t *Bootloader::transmit(const uint8_t *frame, size_t size)
+{
+    std::array<uint8_t, 11> header;
+    if (size < header.size())
+    {
+        throw std::invalid_argument("a command frame starts with its 11 bytes header");
+    }
+    std::copy(frame, frame + header.size(), header.begin());
+    Command command(0);
+    command.fromBytes(header);
+
+    connection.write(frame, size);
+    track(command);
+    return receiveResponse();
+}
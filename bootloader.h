@@ -0,0 +1,121 @@
+#ifndef BOOTLOADER_H
+#define BOOTLOADER_H
+
+#include "hexfile.h"
+#include "attrscache.h"
+#include "connection.h"
+#include "framer.h"
+
+#include <chrono>
+#include <deque>
+#include <stdexcept>
+
+// Must be sent with ERASE_FLASH and WRITE_FLASH, or the bootloader ignores them.
+#define BOOTLOADER_UNLOCK_SEQUENCE 0x00AA0055
+
+#define BOOTLOADER_DEFAULT_TIMEOUT_MS 1000
+#define BOOTLOADER_MIN_TIMEOUT_MS 20
+#define BOOTLOADER_MAX_TIMEOUT_MS 60000
+
+/// @brief Raised when the bootloader answers with something else than SUCCESS,
+/// or does not answer at all (in that case `code` is UNSUPPORTED_COMMAND).
+class BootloaderError : public std::runtime_error
+{
+public:
+    ResponseCode code;
+    BootloaderError(const std::string &what, ResponseCode code)
+        : std::runtime_error(what), code(code) {}
+};
+
+/// @brief Checksum of `size` bytes of program memory, computed like the bootloader does for CALC_CHECKSUM.
+// Program memory is read one instruction (4 bytes in the HEX file) at a time : the low word and the
+// upper byte are summed, the phantom byte is ignored. Only the low 16 bits are sent back by the bootloader,
+// so compare with `& 0xFFFF`.
+unsigned int localChecksum(const uint8_t *data, size_t size);
+unsigned int localChecksum(const std::vector<uint8_t> &data);
+
+/// @brief Checksum of `size` bytes of erased flash (every instruction reads 0xFFFFFF).
+unsigned int erasedChecksum(size_t size);
+
+/// @brief fills `size` bytes with erased instructions, as read back from flash : FF FF FF 00.
+void fillErased(uint8_t *data, size_t size);
+
+/// @brief Round trip time of one command, and the timeout derived from it like the TCP retransmission timeout (RFC 6298).
+// timeout = srtt + 4 * rttvar, within [BOOTLOADER_MIN_TIMEOUT_MS, BOOTLOADER_MAX_TIMEOUT_MS], and doubled after
+// each timeout until the next sample (Karn). Before the first sample the conservative initial value is used.
+class RttEstimator
+{
+public:
+    double srtt_ms;
+    double rttvar_ms;
+    unsigned int samples;
+    unsigned int backoff;
+
+    RttEstimator();
+
+    void sample(double rtt_ms);
+    void timedOut();
+    int timeout(int initial_ms) const;
+};
+
+/// @brief The commands of the MCC 16-bit bootloader, one round trip each.
+// Addresses are word addresses (Segment::address()), lengths are in bytes as found in the HEX file.
+class Bootloader
+{
+private:
+    Connection &connection;
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point sent_at;       // of the oldest outstanding command
+    std::deque<Command> outstanding; // sent, not answered yet, oldest first
+    ResponseFramer framer;
+    size_t framed; // size of the last response, still at the head of the framer
+    std::vector<uint8_t> scratch;
+
+    void send(const Command &command, const uint8_t *data = nullptr, size_t size = 0);
+    void track(const Command &command);
+    int timeoutFor(const Command &command) const;
+    const uint8_t *receiveResponse();
+    BootAttrs getBootAttrs(const Version &version);
+
+public:
+    int timeout_ms;
+    unsigned int round_trips;
+
+    // Timeouts follow the round trip times measured for each CommandCode, as ERASE_FLASH and CALC_CHECKSUM
+    // take much longer than WRITE_FLASH. ERASE_FLASH is measured per page, its timeout grows with the pages.
+    // Only commands answered alone are sampled : pipelined responses also wait for the ones before them.
+    // A timeout is taken for the link being lost, not for garbage : bytes which do not make the expected
+    // response are skipped (see ResponseFramer), their count is in `skippedBytes()`.
+    // Without `adaptive_timeouts`, or before the first sample of a command, `timeout_ms` is used.
+    bool adaptive_timeouts;
+    RttEstimator rtt[CommandCode::GET_MEMORY_ADDRESS_RANGE + 1];
+
+    size_t skippedBytes() const { return framer.skipped; }
+
+    explicit Bootloader(Connection &connection);
+
+    Version readVersion();
+    MemoryRange getMemoryAddressRange();
+    BootAttrs getBootAttrs();
+    /// @brief same as `getBootAttrs`, with a single READ_VERSION for a device already in `cache`.
+    // The cached BootAttrs are used if READ_VERSION gives the same version, packet length, erase and write sizes;
+    // otherwise (the bootloader was updated) the full handshake is done again and the cache updated.
+    BootAttrs getBootAttrs(BootAttrsCache &cache, const std::string &port);
+
+    void eraseFlash(unsigned int address, unsigned int pages);
+    /// @brief reads `length` bytes of program memory from word address `address` into `out`.
+    // The range is split in READ_FLASH packets of at most `packet_bytes` bytes (a multiple of 4), and up
+    // to `window` requests are sent before waiting for the first response, to hide the round trip latency.
+    void readFlash(unsigned int address, unsigned int length, uint8_t *out, unsigned int packet_bytes, unsigned int window = 1);
+    void writeFlash(const Segment &chunk);
+    uint16_t calcChecksum(unsigned int address, unsigned int length);
+    void selfVerify();
+    void reset();
+
+    /// @brief sends a command frame encoded beforehand (header and data), as is, and waits for its response.
+    /// @return the response, valid until the next command; its size is given by ResponseFramer::responseSize.
+    const uint8_t *transmit(const uint8_t *frame, size_t size);
+};
+
+#endif /* BOOTLOADER_H */
@@ -0,0 +1,13 @@
+#include "doctest.h"
+
+#include "chunker.h"
+
+SegmentsChunker chunkerFor(unsigned int word_size_bytes, unsigned int write_size)
+{
+    // PIC24 and dsPIC33 : 2 bytes per word in the HEX file, writes of one or two instructions
+    if (word_size_bytes == 2 && write_size == 8)
+        return &Chunker<2, 8>::chunks;
+    if (word_size_bytes == 2 && write_size == 4)
+        return &Chunker<2, 4>::chunks;
+    return nullptr;
+}
@@ -0,0 +1,124 @@
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "segment.h"
+
+#include <algorithm>
+#include <array>
+
+/// @brief `Segment::chunks` and `HexFile::chunks`, with the word size and the write size (the alignment, in bytes)
+/// known at compile time.
+// Every division and modulo by them becomes a shift and a mask, and the data is copied once per chunk.
+// The results are the same as the generic versions, quirks included. `HexFile::chunked` picks an instantiation
+// from BootAttrs (see `chunkerFor`), and falls back to the generic versions for other geometries.
+template <unsigned int WordBytes, unsigned int WriteSize>
+class Chunker
+{
+    static_assert(WordBytes > 0 && WriteSize % WordBytes == 0, "writes are made of whole words");
+
+public:
+    static constexpr unsigned int alignment = WriteSize / WordBytes; // in words
+
+    static unsigned int address(const Segment &segment) { return segment.minimum_address / WordBytes; }
+    static unsigned int size(const Segment &segment) { return segment.data.size() / WordBytes; }
+
+    /// @brief same as `segment.chunks(size, alignment, padding)`, appended to `out`.
+    static void chunks(const Segment &segment, unsigned int size, const std::vector<uint8_t> &padding, std::vector<Segment> &out)
+    {
+        if (size % alignment != 0)
+        {
+            throw std::invalid_argument("size is not a multiple of alignment");
+        }
+        if (!padding.empty() && padding.size() != WordBytes)
+        {
+            throw std::invalid_argument("padding must be a word value");
+        }
+
+        unsigned int address = segment.minimum_address;
+        size_t before = 0; // padding words in front of the data
+        size_t after = 0;  // and behind
+        if (!padding.empty())
+        {
+            unsigned int align_offset = address % WriteSize;
+            address -= align_offset;
+            before = align_offset / WordBytes;
+            after = (((size_t)WriteSize - (before * WordBytes + segment.data.size())) % WriteSize) / WordBytes;
+        }
+
+        std::vector<uint8_t> tmp;
+        tmp.reserve((before + after) * WordBytes + segment.data.size());
+        for (size_t i = 0; i < before; i++)
+            tmp.insert(tmp.end(), padding.begin(), padding.end());
+        tmp.insert(tmp.end(), segment.data.begin(), segment.data.end());
+        for (size_t i = 0; i < after; i++)
+            tmp.insert(tmp.end(), padding.begin(), padding.end());
+
+        // without padding, the first chunk may be shorter and not aligned
+        size_t start = 0;
+        unsigned int chunk_offset = address % WriteSize;
+        if (chunk_offset != 0)
+        {
+            start = WriteSize - chunk_offset;
+            out.push_back(Segment(address, address + start, std::vector<uint8_t>(tmp.begin(), tmp.begin() + start), WordBytes));
+            address += start;
+        }
+
+        size_t byte_size = (size_t)size * WordBytes;
+        for (size_t offset = 0; start + offset < tmp.size(); offset += byte_size)
+        {
+            size_t chunk_size = std::min(byte_size, tmp.size() - start - offset);
+            out.push_back(Segment(address + offset, address + offset + byte_size,
+                                  std::vector<uint8_t>(tmp.begin() + start + offset, tmp.begin() + start + offset + chunk_size),
+                                  WordBytes));
+        }
+    }
+
+    /// @brief same as `HexFile::chunks(size, alignment, padding)` on `segments`.
+    // A chunk starting in the write block where the chunks of the previous segment end is merged with it.
+    static std::vector<Segment> chunks(const std::vector<Segment> &segments, unsigned int size, const std::vector<uint8_t> &padding)
+    {
+        std::vector<Segment> result;
+        size_t byte_size = (size_t)size * WordBytes;
+        size_t expected = 0;
+        for (const Segment &segment : segments)
+            expected += segment.data.size() / std::max(byte_size, (size_t)1) + 2;
+        result.reserve(expected);
+
+        unsigned int previous_end = 0; // word address after the last chunk of the previous segment
+        std::array<uint8_t, WriteSize> previous_tail{};
+        for (const Segment &segment : segments)
+        {
+            size_t first = result.size();
+            chunks(segment, size, padding, result);
+            if (result.size() == first)
+                continue;
+
+            std::array<uint8_t, WriteSize> tail{};
+            const Segment &last = result.back();
+            if (last.data.size() >= WriteSize)
+                std::copy(last.data.end() - WriteSize, last.data.end(), tail.begin());
+            unsigned int end = address(last) + Chunker::size(last);
+
+            for (size_t i = first; i < result.size(); i++)
+            {
+                Segment &chunk = result[i];
+                if (address(chunk) >= previous_end)
+                    continue;
+                // like the generic version, the merged chunk keeps only the overlapping write block
+                std::vector<uint8_t> merged(WriteSize);
+                for (size_t j = 0; j < WriteSize; j++)
+                    merged[j] = previous_tail[j] ^ chunk.data[j] ^ (padding.empty() ? 0 : padding[j % WordBytes]);
+                chunk.data = std::move(merged);
+            }
+            previous_tail = tail;
+            previous_end = end;
+        }
+        return result;
+    }
+};
+
+/// @brief the specialized `Chunker::chunks` for these sizes, nullptr if there is none.
+typedef std::vector<Segment> (*SegmentsChunker)(const std::vector<Segment> &, unsigned int, const std::vector<uint8_t> &);
+SegmentsChunker chunkerFor(unsigned int word_size_bytes, unsigned int write_size);
+
+#endif /* CHUNKER_H */
@@ -0,0 +1,338 @@
+#include "doctest.h"
+
+#include "coflash.h"
+
+#if defined(__cpp_impl_coroutine)
+
+#include <errno.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define FRAME_POOL_GRANULE 64
+#define FRAME_POOL_CLASSES 32
+
+namespace
+{
+    struct FreeFrame
+    {
+        FreeFrame *next;
+    };
+
+    thread_local FreeFrame *free_frames[FRAME_POOL_CLASSES] = {};
+    thread_local size_t heap_allocations = 0;
+
+    /// @brief epoll_ctl, throwing std::runtime_error : a coroutine waiting on an fd epoll does not watch would
+    /// only report a timeout.
+    void control(int epoll, int operation, int fd, struct epoll_event *event)
+    {
+        if (epoll_ctl(epoll, operation, fd, event) != 0)
+        {
+            throw std::runtime_error("epoll_ctl failed on fd " + std::to_string(fd) + ": " + strerror(errno));
+        }
+    }
+}
+
+void *FramePool::allocate(size_t size)
+{
+    size_t size_class = (size + FRAME_POOL_GRANULE - 1) / FRAME_POOL_GRANULE;
+    if (size_class < FRAME_POOL_CLASSES && free_frames[size_class] != nullptr)
+    {
+        FreeFrame *frame = free_frames[size_class];
+        free_frames[size_class] = frame->next;
+        return frame;
+    }
+    heap_allocations++;
+    return ::operator new(size_class * FRAME_POOL_GRANULE);
+}
+
+void FramePool::deallocate(void *frame, size_t size)
+{
+    size_t size_class = (size + FRAME_POOL_GRANULE - 1) / FRAME_POOL_GRANULE;
+    if (size_class >= FRAME_POOL_CLASSES)
+    {
+        ::operator delete(frame);
+        return;
+    }
+    FreeFrame *free_frame = static_cast<FreeFrame *>(frame);
+    free_frame->next = free_frames[size_class];
+    free_frames[size_class] = free_frame;
+}
+
+size_t FramePool::heapAllocations()
+{
+    return heap_allocations;
+}
+
+EpollReactor::EpollReactor() : epoll(epoll_create1(EPOLL_CLOEXEC)), waiting(0)
+{
+    if (epoll < 0)
+    {
+        throw std::runtime_error(std::string("epoll_create1 failed: ") + strerror(errno));
+    }
+}
+
+EpollReactor::~EpollReactor()
+{
+    ::close(epoll);
+}
+
+void EpollReactor::watch(int fd, uint32_t events, int timeout_ms, std::coroutine_handle<> handle, bool *timed_out)
+{
+    if ((size_t)fd >= waiters.size())
+    {
+        waiters.resize(fd + 1, Waiter{nullptr, nullptr, {}, false});
+    }
+    Waiter &waiter = waiters[fd];
+    struct epoll_event event;
+    event.events = events | EPOLLONESHOT;
+    event.data.fd = fd;
+    control(epoll, waiter.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &event);
+    waiter.registered = true;
+
+    waiter.handle = handle;
+    waiter.timed_out = timed_out;
+    waiter.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    *timed_out = false;
+    waiting++;
+}
+
+bool EpollReactor::runOnce(int max_wait_ms)
+{
+    if (waiting == 0)
+        return false;
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point now = Clock::now();
+    Clock::time_point deadline = now + std::chrono::milliseconds(max_wait_ms);
+    for (const Waiter &waiter : waiters)
+    {
+        if (waiter.handle && waiter.deadline < deadline)
+            deadline = waiter.deadline;
+    }
+    int wait_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+
+    struct epoll_event events[16];
+    int count = epoll_wait(epoll, events, 16, std::max(wait_ms, 0));
+    for (int e = 0; e < count; e++)
+    {
+        Waiter &waiter = waiters[events[e].data.fd];
+        std::coroutine_handle<> handle = waiter.handle;
+        if (!handle)
+            continue;
+        waiter.handle = nullptr;
+        waiting--;
+        handle.resume();
+    }
+
+    now = Clock::now();
+    for (size_t fd = 0; fd < waiters.size(); fd++)
+    {
+        Waiter &waiter = waiters[fd];
+        if (waiter.handle && waiter.deadline <= now)
+        {
+            struct epoll_event event = {};
+            control(epoll, EPOLL_CTL_MOD, fd, &event); // disarm
+            std::coroutine_handle<> handle = waiter.handle;
+            waiter.handle = nullptr;
+            *waiter.timed_out = true;
+            waiting--;
+            handle.resume();
+        }
+    }
+    return true;
+}
+
+namespace
+{
+    /// @brief suspends until the reactor reports `fd` ready, or the timeout.
+    struct Readiness
+    {
+        Reactor &reactor;
+        int fd;
+        uint32_t events;
+        int timeout_ms;
+        bool timed_out;
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { reactor.watch(fd, events, timeout_ms, handle, &timed_out); }
+        void await_resume() const
+        {
+            if (timed_out)
+                throw BootloaderError("timeout while waiting for the bootloader", ResponseCode::UNSUPPORTED_COMMAND);
+        }
+    };
+}
+
+CoBootloader::CoBootloader(Reactor &reactor, int fd)
+    : reactor(reactor), fd(fd), timeout_ms(BOOTLOADER_DEFAULT_TIMEOUT_MS)
+{
+    packet.reserve(0x10000 + Command::getSize());
+}
+
+Task<void> CoBootloader::writeAll(const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = ::write(fd, data, size);
+        if (written > 0)
+        {
+            data += written;
+            size -= written;
+        }
+        else if (written < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("serial write failed: ") + strerror(errno));
+        }
+        else
+        {
+            co_await Readiness{reactor, fd, EPOLLOUT, timeout_ms, false};
+        }
+    }
+}
+
+Task<void> CoBootloader::readExactly(uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t received = ::read(fd, data, size);
+        if (received > 0)
+        {
+            data += received;
+            size -= received;
+        }
+        else if (received < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("serial read failed: ") + strerror(errno));
+        }
+        else
+        {
+            co_await Readiness{reactor, fd, EPOLLIN, timeout_ms, false};
+        }
+    }
+}
+
+Task<void> CoBootloader::send(const Command &command, const uint8_t *data, size_t size)
+{
+    std::array<uint8_t, 11> header = command.toBytes();
+    packet.assign(header.begin(), header.end());
+    packet.insert(packet.end(), data, data + size);
+    co_await writeAll(packet.data(), packet.size());
+}
+
+Task<Packet> CoBootloader::receiveHeader(uint8_t command)
+{
+    std::array<uint8_t, 11> buffer;
+    co_await readExactly(buffer.data(), buffer.size());
+    Packet header(0);
+    header.fromBytes(buffer);
+    if (header.getCommand() != command)
+    {
+        throw BootloaderError("unexpected response to command " + std::to_string(command), ResponseCode::UNSUPPORTED_COMMAND);
+    }
+    co_return header;
+}
+
+Task<void> CoBootloader::receiveStatus(Packet header)
+{
+    uint8_t status;
+    co_await readExactly(&status, 1);
+    if (status != ResponseCode::SUCCESS)
+    {
+        throw BootloaderError("command " + std::to_string(header.getCommand()) + " failed with response code " +
+                                  std::to_string(status),
+                              static_cast<ResponseCode>(status));
+    }
+}
+
+Task<BootAttrs> CoBootloader::getBootAttrs()
+{
+    co_await send(Command(CommandCode::READ_VERSION));
+    std::array<uint8_t, 37> buffer;
+    co_await readExactly(buffer.data(), buffer.size());
+    Version version(0);
+    version.fromBytes(buffer);
+    if (version.getCommand() != CommandCode::READ_VERSION)
+    {
+        throw BootloaderError("unexpected response to READ_VERSION", ResponseCode::UNSUPPORTED_COMMAND);
+    }
+
+    co_await send(Command(CommandCode::GET_MEMORY_ADDRESS_RANGE));
+    co_await receiveStatus(co_await receiveHeader(CommandCode::GET_MEMORY_ADDRESS_RANGE));
+    uint32_t range[2];
+    co_await readExactly(reinterpret_cast<uint8_t *>(range), sizeof(range));
+
+    BootAttrs bootattrs;
+    bootattrs.version = version.getVersion();
+    bootattrs.max_packet_length = version.getMaxPacketLength();
+    bootattrs.device_id = version.getDeviceId();
+    bootattrs.erase_size = version.getEraseSize();
+    bootattrs.write_size = version.getWriteSize();
+    bootattrs.memory_start = range[0];
+    bootattrs.memory_end = range[1] + 2;
+
+    bootattrs.has_checksum = true;
+    try
+    {
+        co_await calcChecksum(bootattrs.memory_start, bootattrs.write_size);
+    }
+    catch (const BootloaderError &error)
+    {
+        if (error.code != ResponseCode::UNSUPPORTED_COMMAND)
+            throw;
+        bootattrs.has_checksum = false;
+    }
+    co_return bootattrs;
+}
+
+Task<void> CoBootloader::eraseFlash(unsigned int address, unsigned int pages)
+{
+    co_await send(Command(CommandCode::ERASE_FLASH, pages, BOOTLOADER_UNLOCK_SEQUENCE, address));
+    co_await receiveStatus(co_await receiveHeader(CommandCode::ERASE_FLASH));
+}
+
+Task<void> CoBootloader::writeChunk(const Segment &chunk)
+{
+    co_await send(Command(CommandCode::WRITE_FLASH, chunk.data.size(), BOOTLOADER_UNLOCK_SEQUENCE, chunk.address()),
+                  chunk.data.data(), chunk.data.size());
+    co_await receiveStatus(co_await receiveHeader(CommandCode::WRITE_FLASH));
+}
+
+Task<uint16_t> CoBootloader::calcChecksum(unsigned int address, unsigned int length)
+{
+    co_await send(Command(CommandCode::CALC_CHECKSUM, length, 0, address));
+    co_await receiveStatus(co_await receiveHeader(CommandCode::CALC_CHECKSUM));
+    uint16_t checksum;
+    co_await readExactly(reinterpret_cast<uint8_t *>(&checksum), sizeof(checksum));
+    co_return checksum;
+}
+
+Task<void> CoBootloader::selfVerify()
+{
+    co_await send(Command(CommandCode::SELF_VERIFY));
+    co_await receiveStatus(co_await receiveHeader(CommandCode::SELF_VERIFY));
+}
+
+Task<void> CoBootloader::reset()
+{
+    co_await send(Command(CommandCode::RESET_DEVICE));
+    co_await receiveStatus(co_await receiveHeader(CommandCode::RESET_DEVICE));
+}
+
+Task<void> CoBootloader::flash(const std::vector<Segment> &chunks, BootAttrs bootattrs)
+{
+    co_await eraseFlash(bootattrs.memory_start, (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size);
+    for (const Segment &chunk : chunks)
+    {
+        co_await writeChunk(chunk);
+        if (bootattrs.has_checksum &&
+            co_await calcChecksum(chunk.address(), chunk.data.size()) != (localChecksum(chunk.data) & 0xFFFF))
+        {
+            throw BootloaderError("checksum mismatch after writing chunk at address " + std::to_string(chunk.address()),
+                                  ResponseCode::VERIFY_FAIL);
+        }
+    }
+    co_await selfVerify();
+}
+
+#endif /* __cpp_impl_coroutine */
@@ -0,0 +1,203 @@
+#ifndef COFLASH_H
+#define COFLASH_H
+
+// Coroutine flavour of the Bootloader commands, for programs which already run an event loop.
+// Needs C++20 : with an older standard this header is empty.
+#if defined(__cpp_impl_coroutine)
+
+#include "bootloader.h"
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <optional>
+
+/// @brief Recycles coroutine frames, so that awaiting a command does not hit the heap once warm.
+// Frames are kept in free lists by size class (64 bytes steps), one set per thread.
+class FramePool
+{
+public:
+    static void *allocate(size_t size);
+    static void deallocate(void *frame, size_t size);
+    /// @brief number of frames which had to be taken from the heap by this thread.
+    static size_t heapAllocations();
+};
+
+template <typename T>
+class Task;
+
+namespace detail
+{
+    struct TaskPromiseBase
+    {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+                std::coroutine_handle<> continuation = handle.promise().continuation;
+                return continuation ? continuation : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() { exception = std::current_exception(); }
+
+        static void *operator new(size_t size) { return FramePool::allocate(size); }
+        static void operator delete(void *frame, size_t size) { FramePool::deallocate(frame, size); }
+    };
+
+    template <typename T>
+    struct TaskPromise : TaskPromiseBase
+    {
+        std::optional<T> value;
+        Task<T> get_return_object();
+        void return_value(T result) { value.emplace(std::move(result)); }
+        T result()
+        {
+            if (exception)
+                std::rethrow_exception(exception);
+            return std::move(*value);
+        }
+    };
+
+    template <>
+    struct TaskPromise<void> : TaskPromiseBase
+    {
+        Task<void> get_return_object();
+        void return_void() {}
+        void result()
+        {
+            if (exception)
+                std::rethrow_exception(exception);
+        }
+    };
+}
+
+/// @brief Lazily started coroutine returning a T. `co_await` it from another Task, or `start()` it
+/// from plain code and check `done()` from the event loop.
+template <typename T = void>
+class Task
+{
+public:
+    typedef detail::TaskPromise<T> promise_type;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task &&other) noexcept : handle(other.handle) { other.handle = nullptr; }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (handle)
+            handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+    {
+        handle.promise().continuation = continuation;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+    void start() { handle.resume(); }
+    bool done() const { return handle.done(); }
+    /// @brief result of a finished task, rethrows its exception if it failed.
+    T get() { return handle.promise().result(); }
+};
+
+template <typename T>
+Task<T> detail::TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::TaskPromise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/// @brief What the coroutines need from the event loop of the program : resume `handle` once `fd` is
+/// ready for `events` (EPOLLIN or EPOLLOUT), or after `timeout_ms` with `*timed_out` set.
+// A program with its own loop implements this; EpollReactor is a minimal loop for the others.
+class Reactor
+{
+public:
+    virtual ~Reactor() {}
+    virtual void watch(int fd, uint32_t events, int timeout_ms, std::coroutine_handle<> handle, bool *timed_out) = 0;
+};
+
+class EpollReactor : public Reactor
+{
+private:
+    struct Waiter
+    {
+        std::coroutine_handle<> handle;
+        bool *timed_out;
+        std::chrono::steady_clock::time_point deadline;
+        bool registered;
+    };
+    int epoll;
+    std::vector<Waiter> waiters; // indexed by file descriptor
+    size_t waiting;
+
+public:
+    EpollReactor();
+    ~EpollReactor();
+
+    EpollReactor(const EpollReactor &) = delete;
+    EpollReactor &operator=(const EpollReactor &) = delete;
+
+    void watch(int fd, uint32_t events, int timeout_ms, std::coroutine_handle<> handle, bool *timed_out) override;
+
+    /// @brief waits at most `max_wait_ms` for one event or timeout, resumes the coroutines concerned.
+    /// @return false when no coroutine is waiting.
+    bool runOnce(int max_wait_ms);
+};
+
+/// @brief Same commands as Bootloader, as coroutines suspending on the serial port reads and writes.
+// The port must be non blocking (SerialConnection opens it so). Commands are encoded in a buffer
+// allocated once, with the Packet classes, and responses are decoded in place.
+class CoBootloader
+{
+private:
+    Reactor &reactor;
+    int fd;
+    std::vector<uint8_t> packet;
+
+    Task<void> writeAll(const uint8_t *data, size_t size);
+    Task<void> readExactly(uint8_t *data, size_t size);
+    Task<void> send(const Command &command, const uint8_t *data = nullptr, size_t size = 0);
+    Task<Packet> receiveHeader(uint8_t command);
+    Task<void> receiveStatus(Packet header);
+
+public:
+    int timeout_ms;
+
+    CoBootloader(Reactor &reactor, int fd);
+
+    Task<BootAttrs> getBootAttrs();
+    Task<void> eraseFlash(unsigned int address, unsigned int pages);
+    Task<void> writeChunk(const Segment &chunk);
+    Task<uint16_t> calcChecksum(unsigned int address, unsigned int length);
+    Task<void> selfVerify();
+    Task<void> reset();
+
+    /// @brief same sequence as Flasher::flash.
+    Task<void> flash(const std::vector<Segment> &chunks, BootAttrs bootattrs);
+};
+
+#endif /* __cpp_impl_coroutine */
+
+#endif /* COFLASH_H */
@@ -0,0 +1,163 @@
+#include "connection.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h> // strerror
+#include <termios.h>
+#include <unistd.h>
+
+static speed_t baudrateToSpeed(unsigned int baudrate)
+{
+    switch (baudrate)
+    {
+    case 9600:
+        return B9600;
+    case 19200:
+        return B19200;
+    case 38400:
+        return B38400;
+    case 57600:
+        return B57600;
+    case 115200:
+        return B115200;
+    case 230400:
+        return B230400;
+    case 460800:
+        return B460800;
+    case 921600:
+        return B921600;
+    default:
+        throw std::invalid_argument("unsupported baudrate " + std::to_string(baudrate));
+    }
+}
+
+void Connection::writev(const struct iovec *parts, int count)
+{
+    std::vector<uint8_t> packet;
+    for (int i = 0; i < count; i++)
+    {
+        const uint8_t *part = static_cast<const uint8_t *>(parts[i].iov_base);
+        packet.insert(packet.end(), part, part + parts[i].iov_len);
+    }
+    write(packet.data(), packet.size());
+}
+
+SerialConnection::SerialConnection(const std::string &port, unsigned int baudrate) : fd(-1)
+{
+    speed_t speed = baudrateToSpeed(baudrate);
+
+    fd = ::open(port.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot open " + port + ": " + strerror(errno));
+    }
+
+    struct termios tty;
+    if (tcgetattr(fd, &tty) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("tcgetattr failed on " + port + ": " + strerror(errno));
+    }
+    cfmakeraw(&tty);
+    tty.c_cflag |= CLOCAL | CREAD;
+    tty.c_cflag &= ~(CSTOPB | CRTSCTS);
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    if (tcsetattr(fd, TCSANOW, &tty) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("tcsetattr failed on " + port + ": " + strerror(errno));
+    }
+    tcflush(fd, TCIOFLUSH);
+}
+
+SerialConnection::~SerialConnection()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+void SerialConnection::write(const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            {
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                ::poll(&pfd, 1, -1);
+                continue;
+            }
+            throw std::runtime_error(std::string("serial write failed: ") + strerror(errno));
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+void SerialConnection::writev(const struct iovec *parts, int count)
+{
+    ssize_t written;
+    do
+    {
+        written = ::writev(fd, parts, count);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0 && errno != EAGAIN)
+    {
+        throw std::runtime_error(std::string("serial write failed: ") + strerror(errno));
+    }
+
+    // after a partial write (the output buffer of the port is full), the rest goes part by part
+    size_t done = std::max(written, (ssize_t)0);
+    for (int i = 0; i < count; i++)
+    {
+        if (done >= parts[i].iov_len)
+        {
+            done -= parts[i].iov_len;
+            continue;
+        }
+        write(static_cast<const uint8_t *>(parts[i].iov_base) + done, parts[i].iov_len - done);
+        done = 0;
+    }
+}
+
+size_t SerialConnection::read(uint8_t *data, size_t size, int timeout_ms)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+
+    size_t received = 0;
+    while (received < size)
+    {
+        ssize_t n = ::read(fd, data + received, size - received);
+        if (n > 0)
+        {
+            received += n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR)
+        {
+            throw std::runtime_error(std::string("serial read failed: ") + strerror(errno));
+        }
+
+        int remaining = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+        if (remaining <= 0)
+            break;
+        struct pollfd pfd = {fd, POLLIN, 0};
+        if (::poll(&pfd, 1, remaining) == 0)
+            break;
+    }
+    return received;
+}
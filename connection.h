@@ -0,0 +1,48 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include <sys/uio.h>
+
+/// @brief Byte stream to a bootloader : a serial port, or the simulated bootloader in the tests.
+class Connection
+{
+public:
+    virtual ~Connection() {}
+
+    /// @brief sends all `size` bytes of `data`, throws std::runtime_error on failure.
+    virtual void write(const uint8_t *data, size_t size) = 0;
+
+    /// @brief reads up to `size` bytes into `data`, waiting at most `timeout_ms` milliseconds in total.
+    /// @return the number of bytes read, less than `size` if the timeout expired.
+    virtual size_t read(uint8_t *data, size_t size, int timeout_ms) = 0;
+    /// @brief sends the `count` parts one after the other, as one packet.
+    // By default they are gathered in a buffer and given to `write`; ports override it with writev(2), so that
+    // a WRITE_FLASH payload goes from the image to the kernel without being copied.
+    virtual void writev(const struct iovec *parts, int count);
+};
+
+/// @brief Raw 8N1 serial port, as opened by pyserial in mcbootflash.
+class SerialConnection : public Connection
+{
+private:
+    int fd;
+
+public:
+    SerialConnection(const std::string &port, unsigned int baudrate);
+    ~SerialConnection();
+
+    SerialConnection(const SerialConnection &) = delete;
+    SerialConnection &operator=(const SerialConnection &) = delete;
+
+    void write(const uint8_t *data, size_t size) override;
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override;
+    void writev(const struct iovec *parts, int count) override;
+
+    int getFd() const { return fd; }
+};
+
+#endif /* CONNECTION_H */
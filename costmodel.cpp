@@ -0,0 +1,142 @@
+#include "doctest.h"
+
+#include "costmodel.h"
+
+#include <algorithm>
+
+LinkTiming::LinkTiming()
+    : baudrate(115200), bits_per_byte(10), adapter_latency_ms(1), command_ms(0.05), write_ms_per_block(0.1),
+      erase_ms_per_page(25), read_us_per_instruction(0.5)
+{
+}
+
+double LinkTiming::lineMs(size_t bytes) const
+{
+    return bytes * bits_per_byte * 1000.0 / baudrate;
+}
+
+double LinkTiming::deviceMs(const Command &command, BootAttrs bootattrs) const
+{
+    double ms = command_ms;
+    switch (command.getCommand())
+    {
+    case CommandCode::ERASE_FLASH:
+        ms += erase_ms_per_page * command.getDataLength();
+        break;
+    case CommandCode::WRITE_FLASH:
+        ms += write_ms_per_block * ((command.getDataLength() + bootattrs.write_size - 1) / bootattrs.write_size);
+        break;
+    case CommandCode::READ_FLASH:
+    case CommandCode::CALC_CHECKSUM:
+        ms += read_us_per_instruction * (command.getDataLength() / 4) / 1000.0;
+        break;
+    default:
+        break;
+    }
+    return ms;
+}
+
+TracingConnection::TracingConnection(SimulatedBootloader &device) : device(device)
+{
+}
+
+void TracingConnection::write(const uint8_t *data, size_t size)
+{
+    std::array<uint8_t, 11> header;
+    if (size < header.size())
+    {
+        throw std::invalid_argument("commands must be written whole to be traced");
+    }
+    std::copy(data, data + header.size(), header.begin());
+    Command command(0);
+    command.fromBytes(header);
+
+    device.write(data, size);
+    uint8_t buffer[256];
+    size_t response = 0;
+    size_t n;
+    while ((n = device.read(buffer, sizeof(buffer), 0)) > 0)
+    {
+        pending.insert(pending.end(), buffer, buffer + n);
+        response += n;
+    }
+    trace.push_back({command, size, response});
+}
+
+size_t TracingConnection::read(uint8_t *data, size_t size, int timeout_ms)
+{
+    size_t n = std::min(size, pending.size());
+    std::copy(pending.begin(), pending.begin() + n, data);
+    pending.erase(pending.begin(), pending.begin() + n);
+    return n;
+}
+
+FlashTimeModel::FlashTimeModel(BootAttrs bootattrs, LinkTiming timing) : bootattrs(bootattrs), timing(timing)
+{
+}
+
+std::vector<TracedCommand> FlashTimeModel::traceFlash(const std::vector<Segment> &chunks)
+{
+    SimulatedBootloader device(bootattrs);
+    TracingConnection connection(device);
+    Bootloader bootloader(connection);
+    Flasher(bootloader, bootattrs).flash(chunks);
+    return connection.trace;
+}
+
+std::vector<TracedCommand> FlashTimeModel::traceDelta(const std::vector<Segment> &chunks,
+                                                      const std::vector<Segment> &installed, size_t *rewritten_pages)
+{
+    SimulatedBootloader device(bootattrs);
+    {
+        Bootloader bootloader(device);
+        Flasher(bootloader, bootattrs).flash(installed);
+    }
+    TracingConnection connection(device);
+    Bootloader bootloader(connection);
+    std::vector<size_t> rewritten = Flasher(bootloader, bootattrs).flashDelta(FlashPages(chunks, bootattrs));
+    if (rewritten_pages)
+        *rewritten_pages = rewritten.size();
+    return connection.trace;
+}
+
+double FlashTimeModel::replaySeconds(const std::vector<TracedCommand> &trace, unsigned int window) const
+{
+    if (window == 0)
+    {
+        throw std::invalid_argument("at least one command must be in flight");
+    }
+
+    // time each resource becomes free, and when each response is back at the host
+    double host = 0;
+    double line_out = 0;
+    double device = 0;
+    double line_in = 0;
+    std::vector<double> answered(trace.size());
+    for (size_t i = 0; i < trace.size(); i++)
+    {
+        double sent = host;
+        if (i >= window)
+            sent = std::max(sent, answered[i - window]);
+
+        double received = std::max(sent + timing.adapter_latency_ms, line_out) + timing.lineMs(trace[i].request_bytes);
+        line_out = received;
+        device = std::max(received, device) + timing.deviceMs(trace[i].command, bootattrs);
+        line_in = std::max(device, line_in) + timing.lineMs(trace[i].response_bytes);
+        answered[i] = line_in + timing.adapter_latency_ms;
+        host = sent;
+    }
+    return trace.empty() ? 0 : answered.back() / 1000.0;
+}
+
+FlashTimePrediction FlashTimeModel::predict(const std::vector<Segment> &chunks, const std::vector<Segment> &installed,
+                                            unsigned int window)
+{
+    FlashTimePrediction prediction;
+    std::vector<TracedCommand> full = traceFlash(chunks);
+    prediction.stop_and_wait_s = replaySeconds(full, 1);
+    prediction.pipelined_s = replaySeconds(full, window);
+    prediction.delta_s = replaySeconds(traceDelta(chunks, installed, &prediction.rewritten_pages), 1);
+    prediction.window = window;
+    return prediction;
+}
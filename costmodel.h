@@ -0,0 +1,94 @@
+#ifndef COSTMODEL_H
+#define COSTMODEL_H
+
+#include "flasher.h"
+#include "simulator.h"
+
+/// @brief Timing of the link and of the bootloader firmware, as found in the datasheets or measured once per product.
+struct LinkTiming
+{
+    unsigned int baudrate;
+    double bits_per_byte;            // start, data, parity and stop bits : 10 for 8N1
+    double adapter_latency_ms;       // added once in each direction by the USB-serial adapter and its driver
+    double command_ms;               // parsing and answering any command
+    double write_ms_per_block;       // programming `write_size` bytes
+    double erase_ms_per_page;        // erasing `erase_size` words
+    double read_us_per_instruction;  // reading flash back, for READ_FLASH and CALC_CHECKSUM
+
+    /// @brief 115200 8N1 through a typical USB-serial adapter, and the flash timing of a PIC24 from its datasheet (not measured).
+    LinkTiming();
+
+    /// @brief time to send `bytes` bytes on the line.
+    double lineMs(size_t bytes) const;
+    /// @brief time the bootloader takes to execute the command, once received.
+    double deviceMs(const Command &command, BootAttrs bootattrs) const;
+};
+
+/// @brief One command as it went on the line.
+struct TracedCommand
+{
+    Command command;
+    size_t request_bytes;  // header and data
+    size_t response_bytes;
+};
+
+/// @brief Records the commands sent to a simulated bootloader and the size of its responses.
+// The simulated bootloader answers every command as soon as it is written, and Bootloader writes one
+// command at a time, so each write gives exactly one response.
+class TracingConnection : public Connection
+{
+private:
+    SimulatedBootloader &device;
+    std::deque<uint8_t> pending; // responses not read yet
+
+public:
+    std::vector<TracedCommand> trace;
+
+    explicit TracingConnection(SimulatedBootloader &device);
+
+    void write(const uint8_t *data, size_t size) override;
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override;
+};
+
+/// @brief Predicted duration of each flashing strategy for one image, in seconds.
+struct FlashTimePrediction
+{
+    double stop_and_wait_s; // Flasher::flash, one command at a time
+    double pipelined_s;     // same commands, `window` of them in flight
+    double delta_s;         // Flasher::flashDelta over the installed image
+    unsigned int window;
+    size_t rewritten_pages; // by the delta update
+};
+
+/// @brief Discrete-event model of the host, the link and the bootloader, to predict flashing times without hardware.
+// The command sequence is the exact one the engine sends : Flasher runs against a SimulatedBootloader through
+// a TracingConnection. Each command is then an event going through three resources, each busy with one command
+// at a time and serving them in order : the line to the device, the bootloader, and the line back. The host sends
+// a command once fewer than `window` are unanswered. With more than one in flight, the model assumes the adapter
+// and the UART of the device buffer the next commands while the bootloader is busy with the current one.
+class FlashTimeModel
+{
+private:
+    BootAttrs bootattrs;
+
+public:
+    LinkTiming timing;
+
+    FlashTimeModel(BootAttrs bootattrs, LinkTiming timing);
+
+    /// @brief commands sent by `Flasher::flash(chunks)`.
+    std::vector<TracedCommand> traceFlash(const std::vector<Segment> &chunks);
+    /// @brief commands sent by `Flasher::flashDelta` to update a device holding `installed` to `chunks`.
+    // Like flashDelta, needs a bootloader with CALC_CHECKSUM.
+    std::vector<TracedCommand> traceDelta(const std::vector<Segment> &chunks, const std::vector<Segment> &installed,
+                                          size_t *rewritten_pages = nullptr);
+
+    /// @brief wall-clock time of the commands, with up to `window` of them in flight, in seconds.
+    double replaySeconds(const std::vector<TracedCommand> &trace, unsigned int window = 1) const;
+
+    /// @brief every strategy for `chunks` (from `HexFile::chunked`), the delta from `installed`.
+    FlashTimePrediction predict(const std::vector<Segment> &chunks, const std::vector<Segment> &installed,
+                                unsigned int window = 4);
+};
+
+#endif /* COSTMODEL_H */
@@ -0,0 +1,560 @@
+#include "doctest.h"
+
+#include "flasher.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <errno.h>
+#include <unistd.h>
+
+Flasher::Flasher(Bootloader &bootloader, BootAttrs bootattrs)
+    : bootloader(bootloader), bootattrs(bootattrs)
+{
+}
+
+/// @brief writes one chunk, and checks it when the bootloader supports CALC_CHECKSUM.
+void Flasher::writeChecked(const Segment &chunk)
+{
+    bootloader.writeFlash(chunk);
+    if (bootattrs.has_checksum)
+    {
+        unsigned int local = localChecksum(chunk.data) & 0xFFFF;
+        if (bootloader.calcChecksum(chunk.address(), chunk.data.size()) != local)
+        {
+            throw BootloaderError("checksum mismatch after writing chunk at address " +
+                                      std::to_string(chunk.address()),
+                                  ResponseCode::VERIFY_FAIL);
+        }
+    }
+}
+
+void Flasher::flash(const std::vector<Segment> &chunks)
+{
+    unsigned int pages = (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size;
+    bootloader.eraseFlash(bootattrs.memory_start, pages);
+
+    for (const Segment &chunk : chunks)
+    {
+        writeChecked(chunk);
+    }
+    bootloader.selfVerify();
+}
+
+/// @brief `flash` for an image which gives its chunks through `expand(index, out)` and their checksums through `checksum(index)`.
+// One Segment is expanded into at a time, so only one chunk is materialized while flashing.
+template <class Image>
+void Flasher::flashExpanded(const Image &image)
+{
+    unsigned int pages = (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size;
+    bootloader.eraseFlash(bootattrs.memory_start, pages);
+
+    Segment chunk(0, 0, {}, 2);
+    for (size_t i = 0; i < image.size(); i++)
+    {
+        image.expand(i, chunk);
+        bootloader.writeFlash(chunk);
+        if (bootattrs.has_checksum && bootloader.calcChecksum(chunk.address(), chunk.data.size()) != (image.checksum(i) & 0xFFFF))
+        {
+            throw BootloaderError("checksum mismatch after writing chunk at address " + std::to_string(chunk.address()),
+                                  ResponseCode::VERIFY_FAIL);
+        }
+    }
+    bootloader.selfVerify();
+}
+
+void Flasher::flash(const PackedImage &image)
+{
+    flashExpanded(image);
+}
+
+void Flasher::flash(const PatchedImage &image)
+{
+    flashExpanded(image);
+}
+
+void Flasher::flashPlan(const FlashPlan &plan)
+{
+    BootAttrs compiled = plan.bootattrs();
+    if (compiled.device_id != bootattrs.device_id || compiled.erase_size != bootattrs.erase_size ||
+        compiled.write_size != bootattrs.write_size || compiled.memory_start != bootattrs.memory_start ||
+        compiled.memory_end != bootattrs.memory_end || compiled.max_packet_length > bootattrs.max_packet_length ||
+        compiled.has_checksum != bootattrs.has_checksum)
+    {
+        throw std::invalid_argument("the flash plan was compiled for another device");
+    }
+
+    for (uint32_t i = 0; i < plan.header->steps; i++)
+    {
+        const PlanStep &step = plan.steps[i];
+        const uint8_t *response = bootloader.transmit(plan.at(step.request), step.request_size);
+        const uint8_t *expected = plan.at(step.response);
+        // as in ResponseFramer, the echoed unlock sequence (bytes 3 to 6) is not checked
+        if (memcmp(response, expected, 3) != 0 || memcmp(response + 7, expected + 7, step.response_size - 7) != 0)
+        {
+            Command command(0);
+            std::array<uint8_t, 11> header;
+            std::copy(plan.at(step.request), plan.at(step.request) + header.size(), header.begin());
+            command.fromBytes(header);
+            throw BootloaderError("unexpected response to step " + std::to_string(i) + " of the flash plan, at address " +
+                                      std::to_string(command.getAddress()),
+                                  ResponseCode::VERIFY_FAIL);
+        }
+    }
+}
+
+unsigned int Flasher::flashAutotuned(const std::vector<Segment> &chunks, ChunkSizeCache &cache, const std::string &key)
+{
+    unsigned int pages = (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size;
+    bootloader.eraseFlash(bootattrs.memory_start, pages);
+
+    FlashPages image(chunks, bootattrs);
+    unsigned int best = cache.get(key);
+    size_t page = 0;
+    if (best == 0)
+    {
+        // one page per candidate, the whole page (writes and checksums) is timed
+        std::vector<unsigned int> candidates = chunkSizeCandidates(bootattrs);
+        double best_rate = 0;
+        for (; page < candidates.size() && page < image.pages.size(); page++)
+        {
+            std::vector<Segment> pieces = splitChunks(image.pages[page].chunks, candidates[page]);
+            size_t bytes = 0;
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            for (const Segment &piece : pieces)
+            {
+                writeChecked(piece);
+                bytes += piece.data.size();
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double rate = bytes / std::max(seconds, 1e-9);
+            if (rate > best_rate)
+            {
+                best_rate = rate;
+                best = candidates[page];
+            }
+        }
+        if (best == 0)
+            best = candidates.front();
+        cache.put(key, best);
+    }
+
+    for (; page < image.pages.size(); page++)
+    {
+        for (const Segment &piece : splitChunks(image.pages[page].chunks, best))
+        {
+            writeChecked(piece);
+        }
+    }
+    bootloader.selfVerify();
+    return best;
+}
+
+bool Flasher::pagesMatch(const FlashPages &image, size_t first, size_t last)
+{
+    unsigned int remote = bootloader.calcChecksum(image.pages[first].address, (last - first) * image.pageBytes());
+    return remote == (image.checksum(first, last) & 0xFFFF);
+}
+
+void Flasher::bisect(const FlashPages &image, size_t first, size_t last, unsigned int remote, std::vector<size_t> &mismatched)
+{
+    if ((image.checksum(first, last) & 0xFFFF) == remote)
+        return;
+    if (last - first == 1)
+    {
+        mismatched.push_back(first);
+        return;
+    }
+    size_t middle = first + (last - first) / 2;
+    unsigned int remote_low = bootloader.calcChecksum(image.pages[first].address, (middle - first) * image.pageBytes());
+    bisect(image, first, middle, remote_low, mismatched);
+    bisect(image, middle, last, (remote - remote_low) & 0xFFFF, mismatched);
+}
+
+std::vector<size_t> Flasher::findMismatchedPages(const FlashPages &image)
+{
+    if (!bootattrs.has_checksum)
+    {
+        throw std::runtime_error("the bootloader does not support CALC_CHECKSUM");
+    }
+
+    std::vector<size_t> mismatched;
+    std::vector<std::pair<size_t, size_t>> ranges = image.checksumRanges();
+    for (const std::pair<size_t, size_t> &range : ranges)
+    {
+        unsigned int remote = bootloader.calcChecksum(image.pages[range.first].address,
+                                                      (range.second - range.first) * image.pageBytes());
+        bisect(image, range.first, range.second, remote, mismatched);
+    }
+    return mismatched;
+}
+
+void Flasher::writeChunk(const Segment &chunk, unsigned int attempts)
+{
+    for (unsigned int attempt = 1;; attempt++)
+    {
+        try
+        {
+            bootloader.writeFlash(chunk);
+            return;
+        }
+        catch (const BootloaderError &error)
+        {
+            // a bad address or length will not get better
+            bool transient = error.code == ResponseCode::UNSUPPORTED_COMMAND || error.code == ResponseCode::VERIFY_FAIL;
+            if (!transient || attempt >= attempts)
+                throw;
+        }
+    }
+}
+
+void Flasher::rewritePage(const Page &page)
+{
+    bootloader.eraseFlash(page.address, 1);
+    for (const Segment &chunk : page.chunks)
+    {
+        bootloader.writeFlash(chunk);
+    }
+}
+
+/// @brief erases the pages of [address, address + pages * erase_size) which do not read as erased.
+// `remote` is the device checksum of the whole range, non blank ranges are bisected.
+void Flasher::eraseNonBlank(unsigned int address, unsigned int pages, unsigned int remote)
+{
+    unsigned int page_bytes = bootattrs.erase_size * 2;
+    if (remote == (erasedChecksum(pages * page_bytes) & 0xFFFF))
+        return;
+    if (pages == 1)
+    {
+        bootloader.eraseFlash(address, 1);
+        return;
+    }
+    unsigned int low = pages / 2;
+    unsigned int remote_low = bootloader.calcChecksum(address, low * page_bytes);
+    eraseNonBlank(address, low, remote_low);
+    eraseNonBlank(address + low * bootattrs.erase_size, pages - low, (remote - remote_low) & 0xFFFF);
+}
+
+void Flasher::eraseNonBlank(unsigned int address, unsigned int pages)
+{
+    unsigned int page_bytes = bootattrs.erase_size * 2;
+    unsigned int max_pages = 0xFFFF / page_bytes;
+    while (pages > 0)
+    {
+        unsigned int count = std::min(pages, max_pages);
+        eraseNonBlank(address, count, bootloader.calcChecksum(address, count * page_bytes));
+        address += count * bootattrs.erase_size;
+        pages -= count;
+    }
+}
+
+std::vector<size_t> Flasher::flashDelta(const FlashPages &image)
+{
+    if (!bootattrs.has_checksum)
+    {
+        throw std::runtime_error("the bootloader does not support CALC_CHECKSUM");
+    }
+
+    std::vector<size_t> rewritten;
+    unsigned int address = bootattrs.memory_start;
+    for (size_t i = 0; i < image.pages.size(); i++)
+    {
+        const Page &page = image.pages[i];
+        if (page.address > address)
+        {
+            eraseNonBlank(address, (page.address - address) / image.page_words);
+        }
+        address = page.address + image.page_words;
+
+        if (pagesMatch(image, i, i + 1))
+            continue;
+        rewritePage(page);
+        if (!pagesMatch(image, i, i + 1))
+        {
+            throw BootloaderError("page at address " + std::to_string(page.address) +
+                                      " differs after being rewritten",
+                                  ResponseCode::VERIFY_FAIL);
+        }
+        rewritten.push_back(i);
+    }
+    if ((unsigned int)bootattrs.memory_end > address)
+    {
+        eraseNonBlank(address, (bootattrs.memory_end - address) / image.page_words);
+    }
+
+    bootloader.selfVerify();
+    return rewritten;
+}
+
+/// @brief checks the whole program memory against the shadow, 0xFFFF bytes at most per CALC_CHECKSUM.
+bool Flasher::shadowMatches(ShadowImage &shadow)
+{
+    unsigned int page_bytes = bootattrs.erase_size * 2;
+    unsigned int max_words = (0xFFFF / page_bytes) * bootattrs.erase_size;
+    for (unsigned int address = bootattrs.memory_start; address < (unsigned int)bootattrs.memory_end; address += max_words)
+    {
+        unsigned int length = std::min(max_words, bootattrs.memory_end - address) * 2;
+        if (bootloader.calcChecksum(address, length) != (localChecksum(shadow.at(address), length) & 0xFFFF))
+            return false;
+    }
+    return true;
+}
+
+/// @brief copies the image to the shadow, program memory outside of the image being erased.
+void Flasher::record(const FlashPages &image, ShadowImage &shadow)
+{
+    fillErased(shadow.memory, shadow.memory_size);
+    for (size_t i = 0; i < image.pages.size(); i++)
+    {
+        image.render(i, shadow.at(image.pages[i].address));
+    }
+}
+
+std::vector<unsigned int> Flasher::flashShadowed(const FlashPages &image, ShadowImage &shadow)
+{
+    if (!bootattrs.has_checksum)
+    {
+        throw std::runtime_error("the bootloader does not support CALC_CHECKSUM");
+    }
+
+    std::vector<unsigned int> sent;
+    if (shadow.getState() != SHADOW_VALID)
+    {
+        shadow.setState(SHADOW_DIRTY);
+        for (size_t index : flashDelta(image))
+        {
+            sent.push_back(image.pages[index].address);
+        }
+        record(image, shadow);
+        shadow.setState(SHADOW_VALID);
+        return sent;
+    }
+
+    shadow.setState(SHADOW_DIRTY);
+    std::vector<uint8_t> page(image.pageBytes());
+    size_t next = 0;
+    for (unsigned int address = bootattrs.memory_start; address < (unsigned int)bootattrs.memory_end; address += image.page_words)
+    {
+        bool in_image = next < image.pages.size() && image.pages[next].address == address;
+        if (in_image)
+            image.render(next, page.data());
+        else
+            fillErased(page.data(), page.size());
+
+        if (memcmp(shadow.at(address), page.data(), page.size()) != 0)
+        {
+            if (in_image)
+                rewritePage(image.pages[next]);
+            else
+                bootloader.eraseFlash(address, 1);
+            memcpy(shadow.at(address), page.data(), page.size());
+            sent.push_back(address);
+        }
+        if (in_image)
+            next++;
+    }
+
+    if (shadowMatches(shadow))
+    {
+        bootloader.selfVerify();
+    }
+    else
+    {
+        // the device does not hold what the shadow says : repair it from the image
+        for (size_t index : flashDelta(image))
+        {
+            sent.push_back(image.pages[index].address);
+        }
+    }
+    shadow.setState(SHADOW_VALID);
+    return sent;
+}
+
+std::vector<size_t> Flasher::verifyAndRepair(const FlashPages &image)
+{
+    std::vector<size_t> mismatched = findMismatchedPages(image);
+    for (size_t index : mismatched)
+    {
+        rewritePage(image.pages[index]);
+        if (!pagesMatch(image, index, index + 1))
+        {
+            throw BootloaderError("page at address " + std::to_string(image.pages[index].address) +
+                                      " still differs after being rewritten",
+                                  ResponseCode::VERIFY_FAIL);
+        }
+    }
+    if (!mismatched.empty())
+    {
+        bootloader.selfVerify();
+    }
+    return mismatched;
+}
+
+/// @brief writes (after erasing it if asked) one page of the image and checks it, recording each step.
+/// @return false if the checksum does not match.
+bool Flasher::writePage(const FlashPages &image, size_t index, bool erase, ProgressJournal &journal, unsigned int attempts)
+{
+    const Page &page = image.pages[index];
+    if (erase)
+    {
+        bootloader.eraseFlash(page.address, 1);
+        journal.record(JOURNAL_ERASED, page.address);
+    }
+    for (const Segment &chunk : page.chunks)
+    {
+        writeChunk(chunk, attempts);
+    }
+    journal.record(JOURNAL_WRITTEN, page.address);
+    if (!pagesMatch(image, index, index + 1))
+        return false;
+    journal.record(JOURNAL_VERIFIED, page.address);
+    return true;
+}
+
+std::vector<size_t> Flasher::flashResumable(const FlashPages &image, ProgressJournal &journal, unsigned int attempts)
+{
+    if (!bootattrs.has_checksum)
+    {
+        throw std::runtime_error("the bootloader does not support CALC_CHECKSUM");
+    }
+
+    uint32_t image_id = ProgressJournal::imageId(image);
+    if (journal.image_id != image_id)
+    {
+        journal.start(image_id);
+    }
+    if (!journal.erased_all)
+    {
+        bootloader.eraseFlash(bootattrs.memory_start, (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size);
+        journal.record(JOURNAL_ERASED_ALL);
+    }
+
+    std::vector<size_t> written;
+    for (size_t i = 0; i < image.pages.size(); i++)
+    {
+        const Page &page = image.pages[i];
+        // a page only erased (or not even) since the full erase can be written again as is, the others are checked
+        JournalEvent state = journal.state(page.address);
+        bool erase = false;
+        if (state == JOURNAL_WRITTEN || state == JOURNAL_VERIFIED)
+        {
+            if (pagesMatch(image, i, i + 1))
+            {
+                if (state != JOURNAL_VERIFIED)
+                    journal.record(JOURNAL_VERIFIED, page.address);
+                continue;
+            }
+            erase = true;
+        }
+
+        for (unsigned int attempt = 1; !writePage(image, i, erase, journal, attempts); attempt++)
+        {
+            if (attempt >= attempts)
+            {
+                throw BootloaderError("page at address " + std::to_string(page.address) + " does not verify after " +
+                                          std::to_string(attempts) + " attempts",
+                                      ResponseCode::VERIFY_FAIL);
+            }
+            erase = true;
+        }
+        written.push_back(i);
+    }
+
+    bootloader.selfVerify();
+    journal.finish();
+    return written;
+}
+
+HexFile Flasher::dump(unsigned int window, bool skip_erased)
+{
+    unsigned int packet_bytes = bootattrs.max_packet_length - Response::getSize();
+    packet_bytes -= packet_bytes % std::max(bootattrs.write_size, 4);
+
+    HexFile hexfile;
+    unsigned int page_bytes = bootattrs.erase_size * 2;
+    std::vector<uint8_t> page(page_bytes);
+    for (unsigned int address = bootattrs.memory_start; address < (unsigned int)bootattrs.memory_end;
+         address += bootattrs.erase_size)
+    {
+        unsigned int length = std::min(page_bytes, (bootattrs.memory_end - address) * 2);
+        bootloader.readFlash(address, length, page.data(), packet_bytes, window);
+        if (!skip_erased)
+        {
+            hexfile.add_binary(std::vector<uint8_t>(page.begin(), page.begin() + length), address * 2);
+            continue;
+        }
+
+        // only whole write blocks are left out : `chunked` pads a partial block with 0x00 words, so an erased
+        // instruction next to programmed ones in its block must be kept to be written back erased
+        static const uint8_t erased[4] = {0xff, 0xff, 0xff, 0x00};
+        unsigned int block = std::max(bootattrs.write_size, 4);
+        unsigned int start = 0;
+        for (unsigned int i = 0; i < length + block; i += block)
+        {
+            bool blank = i < length;
+            for (unsigned int j = i; blank && j < std::min(i + block, length); j += 4)
+                blank = std::memcmp(&page[j], erased, 4) == 0;
+            if (i < length && !blank)
+                continue;
+            if (i > start)
+                hexfile.add_binary(std::vector<uint8_t>(page.begin() + start, page.begin() + std::min(i, length)),
+                                   address * 2 + start);
+            start = i + block;
+        }
+    }
+    return hexfile;
+}
+
+void Flasher::snapshot(const std::string &path, unsigned int window)
+{
+    std::string records = dump(window).as_ihex();
+
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+    {
+        throw std::runtime_error("cannot create snapshot " + temporary + ": " + strerror(errno));
+    }
+    bool written = fwrite(records.data(), 1, records.size(), file) == records.size() &&
+                   fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = (fclose(file) == 0) && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::string reason = strerror(errno);
+        unlink(temporary.c_str());
+        throw std::runtime_error("cannot write snapshot " + path + ": " + reason);
+    }
+}
+
+std::vector<size_t> Flasher::rollback(const std::string &path)
+{
+    HexFile hex;
+    if (!hex.load(path))
+    {
+        throw std::runtime_error("cannot read snapshot " + path);
+    }
+
+    // a snapshot of a blank device holds no data, which `chunked` refuses
+    std::vector<Segment> chunks;
+    if (hex.totalLength() != 0)
+    {
+        chunks = hex.chunked(bootattrs);
+    }
+    return flashDelta(FlashPages(chunks, bootattrs));
+}
+
+std::vector<size_t> Flasher::update(const FlashPages &image, const std::string &snapshot_path, unsigned int window)
+{
+    snapshot(snapshot_path, window);
+    try
+    {
+        return flashDelta(image);
+    }
+    catch (const BootloaderError &)
+    {
+        rollback(snapshot_path);
+        throw;
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef FLASHER_H
+#define FLASHER_H
+
+#include "autotune.h"
+#include "bootloader.h"
+#include "flashpages.h"
+#include "journal.h"
+#include "packed.h"
+#include "patch.h"
+#include "plan.h"
+#include "shadow.h"
+
+/// @brief Flashing strategies, on top of the bootloader commands.
+class Flasher
+{
+private:
+    Bootloader &bootloader;
+    BootAttrs bootattrs;
+
+    void writeChecked(const Segment &chunk);
+    template <class Image>
+    void flashExpanded(const Image &image);
+    void eraseNonBlank(unsigned int address, unsigned int pages, unsigned int remote);
+    void eraseNonBlank(unsigned int address, unsigned int pages);
+    bool shadowMatches(ShadowImage &shadow);
+    void record(const FlashPages &image, ShadowImage &shadow);
+    bool writePage(const FlashPages &image, size_t index, bool erase, ProgressJournal &journal, unsigned int attempts);
+    void bisect(const FlashPages &image, size_t first, size_t last, unsigned int remote, std::vector<size_t> &mismatched);
+
+public:
+    Flasher(Bootloader &bootloader, BootAttrs bootattrs);
+
+    /// @brief erases the whole program memory, writes every chunk and checks it, then asks the bootloader to self verify.
+    void flash(const std::vector<Segment> &chunks);
+    /// @brief same as `flash`, each chunk being expanded from the packed image just before it is written.
+    void flash(const PackedImage &image);
+    /// @brief same as `flash`, with the patches of the device applied to each chunk just before it is written.
+    void flash(const PatchedImage &image);
+
+    /// @brief same as `flash`, from a plan compiled beforehand : the frames are sent as they are in the file.
+    // Each response must be the one expected by the plan, byte for byte, which checks the chunks against their
+    // local checksums. Throws std::invalid_argument if the plan was compiled for another device or memory layout.
+    void flashPlan(const FlashPlan &plan);
+
+    /// @brief same as `flash`, with the chunk size which gives the best throughput on this link.
+    // Without a size cached for `key` (see ChunkSizeCache::key), the first pages are each written with one of
+    // `chunkSizeCandidates`, timed, and the fastest size is kept in the cache and used for the other pages.
+    // Some adapters are faster with packets smaller than the bootloader allows, because of driver buffering.
+    /// @return the chunk size used.
+    unsigned int flashAutotuned(const std::vector<Segment> &chunks, ChunkSizeCache &cache, const std::string &key);
+
+    /// @brief local vs device checksum of pages [first, last), which must be contiguous.
+    bool pagesMatch(const FlashPages &image, size_t first, size_t last);
+
+    /// @brief finds the pages whose content differs from the image.
+    // Every range given by `FlashPages::checksumRanges` is checked with one CALC_CHECKSUM. A range that does not
+    // match is bisected : only the first half is asked to the device, the checksum of the second half is the
+    // difference. k bad pages among n are found in about k * log2(n) round trips.
+    std::vector<size_t> findMismatchedPages(const FlashPages &image);
+
+    /// @brief erases one page and writes its chunks again.
+    void rewritePage(const Page &page);
+
+    /// @brief updates the device to the image, touching only what changed.
+    // Each page of the image costs one CALC_CHECKSUM, and is erased and rewritten only when it differs.
+    // Program memory outside the image is checked by runs of pages, and the pages which are not blank
+    // are found by bisection and erased, so the device ends up as after `flash`.
+    /// @return the indexes (in `image.pages`) of the rewritten pages.
+    std::vector<size_t> flashDelta(const FlashPages &image);
+
+    /// @brief updates the device to the image by diffing it against the shadow of the device, without asking the device.
+    // Only the pages which differ from the shadow are erased and rewritten, then the whole program memory is
+    // checked against the shadow with as few CALC_CHECKSUM as the 16 bits length allows. If the device was
+    // flashed by someone else in the meantime (or the shadow is unknown), falls back to `flashDelta`.
+    // The shadow is marked dirty during the update, and holds the image once this returns.
+    /// @return the word addresses of the pages erased or rewritten.
+    std::vector<unsigned int> flashShadowed(const FlashPages &image, ShadowImage &shadow);
+
+    /// @brief checks the device against the image, and rewrites only the pages that differ.
+    /// @return the indexes (in `image.pages`) of the rewritten pages.
+    std::vector<size_t> verifyAndRepair(const FlashPages &image);
+
+    /// @brief writes one chunk, again up to `attempts` times in all if the bootloader does not answer or fails to verify it.
+    // Writing the same data twice is harmless : flash programming can only clear bits.
+    void writeChunk(const Segment &chunk, unsigned int attempts);
+
+    /// @brief same result as `flash`, but an interrupted update can be resumed from `journal`.
+    // Every step (whole memory erased, page erased, page written, page verified) is recorded in the journal
+    // before the next one. A run finding the journal of the same image skips the full erase, checks the pages
+    // already written with CALC_CHECKSUM, and only writes the others. Chunks are retried `attempts` times,
+    // a page that does not verify is erased and written again up to `attempts` times. The journal is removed
+    // once the bootloader has verified the application.
+    /// @return the indexes (in `image.pages`) of the pages written by this run.
+    std::vector<size_t> flashResumable(const FlashPages &image, ProgressJournal &journal, unsigned int attempts = 3);
+
+    /// @brief reads the whole program memory back, with READ_FLASH packets as large as the bootloader accepts.
+    // Memory is read one page at a time, keeping up to `window` requests in flight (1 is stop-and-wait).
+    // With `skip_erased`, erased write blocks are left out, so that the result looks like the HEX file it was
+    // flashed from; otherwise every instruction is kept. `as_ihex` / `as_binary` give the file to write.
+    HexFile dump(unsigned int window = 1, bool skip_erased = true);
+
+    /// @brief saves the application currently on the device to `path`, as a HEX file without the erased write blocks.
+    // The file is written next to `path`, synced, then renamed, so a snapshot is either complete or absent.
+    void snapshot(const std::string &path, unsigned int window = 1);
+
+    /// @brief brings the device back to the snapshot at `path` with `flashDelta`, so only the pages changed since are written.
+    /// @return the indexes (in the snapshot pages) of the rewritten pages.
+    std::vector<size_t> rollback(const std::string &path);
+
+    /// @brief snapshots the device to `snapshot_path`, then updates it to the image with `flashDelta`.
+    // If the update fails (a page that does not verify, or SELF_VERIFY rejecting the new application), the
+    // snapshot is restored before the error is rethrown, so the device keeps a working application.
+    /// @return the indexes (in `image.pages`) of the rewritten pages.
+    std::vector<size_t> update(const FlashPages &image, const std::string &snapshot_path, unsigned int window = 1);
+};
+
+#endif /* FLASHER_H */
@@ -0,0 +1,114 @@
+#include "doctest.h"
+
+#include "flashpages.h"
+#include "bootloader.h"
+
+FlashPages::FlashPages(const std::vector<Segment> &chunks, BootAttrs bootattrs)
+    : page_words(bootattrs.erase_size), max_checksum_pages(0)
+{
+    if (bootattrs.erase_size <= 0 || (pageBytes() % bootattrs.write_size) != 0)
+    {
+        throw std::invalid_argument("erase page must be a multiple of the write size");
+    }
+    max_checksum_pages = 0xFFFF / pageBytes();
+    if (max_checksum_pages == 0)
+    {
+        throw std::invalid_argument("erase page too large for CALC_CHECKSUM");
+    }
+
+    unsigned int page_bytes = pageBytes();
+    for (const Segment &chunk : chunks)
+    {
+        // chunks may cross page boundaries : cut them, page boundaries are aligned on write blocks
+        unsigned int begin = chunk.minimum_address;
+        unsigned int end = chunk.minimum_address + chunk.data.size();
+        while (begin < end)
+        {
+            unsigned int page_address = (begin / page_bytes) * page_words;
+            unsigned int cut = std::min(end, (begin / page_bytes + 1) * page_bytes);
+
+            if (pages.empty() || pages.back().address != page_address)
+            {
+                if (!pages.empty() && pages.back().address > page_address)
+                {
+                    throw std::invalid_argument("chunks must be sorted by address");
+                }
+                Page page;
+                page.address = page_address;
+                page.checksum = erasedChecksum(page_bytes);
+                pages.push_back(page);
+            }
+
+            // HexFile::chunks merges the last write block of a segment with the first one of the
+            // next segment when they share it : the merged block replaces the previous one
+            std::vector<Segment> &page_chunks = pages.back().chunks;
+            if (!page_chunks.empty() && page_chunks.back().maximum_address > begin)
+            {
+                Segment &previous = page_chunks.back();
+                std::vector<uint8_t> tail(previous.data.begin() + (begin - previous.minimum_address), previous.data.end());
+                pages.back().checksum -= localChecksum(tail) - erasedChecksum(tail.size());
+                previous.data.resize(begin - previous.minimum_address);
+                previous.maximum_address = begin;
+                if (previous.data.empty())
+                    page_chunks.pop_back();
+            }
+
+            std::vector<uint8_t> data(chunk.data.begin() + (begin - chunk.minimum_address),
+                                      chunk.data.begin() + (cut - chunk.minimum_address));
+            pages.back().checksum += localChecksum(data) - erasedChecksum(data.size());
+            pages.back().chunks.push_back(Segment(begin, cut, data, chunk.word_size_bytes));
+            begin = cut;
+        }
+    }
+}
+
+unsigned int FlashPages::pageBytes() const
+{
+    return page_words * 2;
+}
+
+bool FlashPages::contiguous(size_t first, size_t last) const
+{
+    for (size_t i = first + 1; i < last; i++)
+    {
+        if (pages[i].address != pages[i - 1].address + page_words)
+            return false;
+    }
+    return true;
+}
+
+unsigned int FlashPages::checksum(size_t first, size_t last) const
+{
+    unsigned int sum = 0;
+    for (size_t i = first; i < last; i++)
+    {
+        sum += pages[i].checksum;
+    }
+    return sum;
+}
+
+void FlashPages::render(size_t index, uint8_t *out) const
+{
+    const Page &page = pages[index];
+    fillErased(out, pageBytes());
+    for (const Segment &chunk : page.chunks)
+    {
+        memcpy(out + (chunk.minimum_address - page.address * 2), chunk.data.data(), chunk.data.size());
+    }
+}
+
+std::vector<std::pair<size_t, size_t>> FlashPages::checksumRanges() const
+{
+    std::vector<std::pair<size_t, size_t>> ranges;
+    size_t first = 0;
+    for (size_t i = 1; i <= pages.size(); i++)
+    {
+        if (i == pages.size() || i - first == max_checksum_pages ||
+            pages[i].address != pages[i - 1].address + page_words)
+        {
+            ranges.push_back(std::make_pair(first, i));
+            first = i;
+        }
+    }
+    return ranges;
+}
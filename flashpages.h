@@ -0,0 +1,38 @@
+#ifndef FLASHPAGES_H
+#define FLASHPAGES_H
+
+#include "hexfile.h"
+
+#include <utility>
+
+/// @brief One erase page of program memory, with the part of the image that goes in it.
+struct Page
+{
+    unsigned int address;        // word address of the first word of the page
+    std::vector<Segment> chunks; // image data of this page, cut in WRITE_FLASH chunks
+    unsigned int checksum;       // local checksum of the whole page, words not in the image read as erased
+};
+
+/// @brief The image returned by `HexFile::chunked`, split along the erase pages of the device.
+// A page can be erased and rewritten on its own, and its checksum is known without asking the device.
+class FlashPages
+{
+public:
+    unsigned int page_words;         // erase page size in words (BootAttrs::erase_size)
+    unsigned int max_checksum_pages; // CALC_CHECKSUM lengths are 16 bits
+    std::vector<Page> pages;         // sorted by address, only the pages touched by the image
+
+    FlashPages(const std::vector<Segment> &chunks, BootAttrs bootattrs);
+
+    unsigned int pageBytes() const;
+    /// @brief true if pages [first, last) follow each other in memory.
+    bool contiguous(size_t first, size_t last) const;
+    /// @brief local checksum of pages [first, last), to compare with `& 0xFFFF`.
+    unsigned int checksum(size_t first, size_t last) const;
+    /// @brief writes the `pageBytes()` bytes of page `index`, as the device holds them once flashed.
+    void render(size_t index, uint8_t *out) const;
+    /// @brief splits the pages in ranges [first, last) that can each be checked with a single CALC_CHECKSUM.
+    std::vector<std::pair<size_t, size_t>> checksumRanges() const;
+};
+
+#endif /* FLASHPAGES_H */
@@ -0,0 +1,440 @@
+#include "doctest.h"
+
+#include "fleet.h"
+#include "bootloader.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+FlashSession::FlashSession(std::shared_ptr<const std::vector<Segment>> chunks, BootAttrs bootattrs)
+    : chunks(chunks), bootattrs(bootattrs), chunk_index(0), request_sent(0),
+      current(CommandCode::READ_VERSION), response(nullptr), state(HANDSHAKE_VERSION)
+{
+    send(Command(CommandCode::READ_VERSION));
+}
+
+void FlashSession::send(const Command &command, const uint8_t *data, size_t size)
+{
+    std::array<uint8_t, 11> header = command.toBytes();
+    request.assign(header.begin(), header.end());
+    request.insert(request.end(), data, data + size);
+    request_sent = 0;
+    current = command;
+}
+
+void FlashSession::fail(const std::string &reason)
+{
+    state = FAILED;
+    error = reason;
+    request.clear();
+    request_sent = 0;
+}
+
+void FlashSession::timeout()
+{
+    fail("timeout while waiting for the bootloader");
+}
+
+void FlashSession::receive(const uint8_t *data, size_t size)
+{
+    if (finished())
+        return;
+    framer.feed(data, size);
+
+    while (!finished())
+    {
+        size_t framed = framer.frame(current);
+        if (framed == 0)
+            return;
+        response = framer.data();
+        uint8_t command = current.getCommand();
+        if (command != CommandCode::READ_VERSION && response[11] != ResponseCode::SUCCESS)
+        {
+            fail("command " + std::to_string(command) + " failed with response code " + std::to_string(response[11]));
+            return;
+        }
+        handleResponse();
+        framer.consume(framed);
+    }
+}
+
+void FlashSession::next()
+{
+    if (chunk_index < chunks->size())
+    {
+        const Segment &chunk = (*chunks)[chunk_index];
+        state = WRITE;
+        send(Command(CommandCode::WRITE_FLASH, chunk.data.size(), BOOTLOADER_UNLOCK_SEQUENCE, chunk.address()),
+             chunk.data.data(), chunk.data.size());
+    }
+    else
+    {
+        state = SELF_VERIFY;
+        send(Command(CommandCode::SELF_VERIFY));
+    }
+}
+
+void FlashSession::handleResponse()
+{
+    switch (state)
+    {
+    case HANDSHAKE_VERSION:
+    {
+        std::array<uint8_t, 37> buffer;
+        std::copy(response, response + buffer.size(), buffer.begin());
+        Version version(0);
+        version.fromBytes(buffer);
+        if (version.getDeviceId() != bootattrs.device_id || version.getEraseSize() != bootattrs.erase_size ||
+            version.getWriteSize() != bootattrs.write_size || version.getMaxPacketLength() < bootattrs.max_packet_length)
+        {
+            fail("device " + std::to_string(version.getDeviceId()) + " does not match the image");
+            return;
+        }
+        state = HANDSHAKE_RANGE;
+        send(Command(CommandCode::GET_MEMORY_ADDRESS_RANGE));
+        break;
+    }
+    case HANDSHAKE_RANGE:
+    {
+        uint32_t program_start;
+        uint32_t program_end;
+        memcpy(&program_start, response + Response::getSize(), sizeof(program_start));
+        memcpy(&program_end, response + Response::getSize() + sizeof(program_start), sizeof(program_end));
+        if (program_start != (uint32_t)bootattrs.memory_start || program_end + 2 != (uint32_t)bootattrs.memory_end)
+        {
+            fail("program memory range of the device does not match the image");
+            return;
+        }
+        state = ERASE;
+        send(Command(CommandCode::ERASE_FLASH, (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size,
+                     BOOTLOADER_UNLOCK_SEQUENCE, bootattrs.memory_start));
+        break;
+    }
+    case ERASE:
+        next();
+        break;
+    case WRITE:
+        if (bootattrs.has_checksum)
+        {
+            const Segment &chunk = (*chunks)[chunk_index];
+            state = CHECKSUM;
+            send(Command(CommandCode::CALC_CHECKSUM, chunk.data.size(), 0, chunk.address()));
+        }
+        else
+        {
+            chunk_index++;
+            next();
+        }
+        break;
+    case CHECKSUM:
+    {
+        const Segment &chunk = (*chunks)[chunk_index];
+        uint16_t remote;
+        memcpy(&remote, response + Response::getSize(), sizeof(remote));
+        if (remote != (localChecksum(chunk.data) & 0xFFFF))
+        {
+            fail("checksum mismatch after writing chunk at address " + std::to_string(chunk.address()));
+            return;
+        }
+        chunk_index++;
+        next();
+        break;
+    }
+    case SELF_VERIFY:
+        state = DONE;
+        request.clear();
+        request_sent = 0;
+        break;
+    default:
+        break;
+    }
+}
+
+FleetFlasher::FleetFlasher(std::shared_ptr<const std::vector<Segment>> chunks, BootAttrs bootattrs)
+    : chunks(chunks), bootattrs(bootattrs), timeout_ms(BOOTLOADER_DEFAULT_TIMEOUT_MS), backend(FLEET_EPOLL)
+{
+}
+
+void FleetFlasher::add(const std::string &path, unsigned int baudrate)
+{
+    Port port;
+    port.path = path;
+    port.connection.reset(new SerialConnection(path, baudrate));
+    port.session.reset(new FlashSession(chunks, bootattrs));
+    port.writable = false;
+    port.registered = false;
+    ports.push_back(std::move(port));
+}
+
+unsigned int FleetFlasher::run()
+{
+    if (backend == FLEET_IO_URING)
+        runUring();
+    else
+        runEpoll();
+
+    unsigned int failed = 0;
+    for (Port &port : ports)
+    {
+        if (port.session->state == FlashSession::FAILED)
+            failed++;
+    }
+    return failed;
+}
+
+void FleetFlasher::runEpoll()
+{
+    typedef std::chrono::steady_clock Clock;
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0)
+    {
+        throw std::runtime_error(std::string("epoll_create1 failed: ") + strerror(errno));
+    }
+    // a port epoll does not watch would stay silent until its deadline : any failure ends the run
+    auto control = [epoll](int operation, int fd, struct epoll_event *event)
+    {
+        if (epoll_ctl(epoll, operation, fd, event) != 0)
+        {
+            std::string reason = strerror(errno);
+            ::close(epoll);
+            throw std::runtime_error("epoll_ctl failed on fd " + std::to_string(fd) + ": " + reason);
+        }
+    };
+
+    for (size_t i = 0; i < ports.size(); i++)
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT;
+        event.data.u64 = i;
+        ports[i].writable = true;
+        ports[i].registered = true;
+        ports[i].deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+        control(EPOLL_CTL_ADD, ports[i].connection->getFd(), &event);
+    }
+
+    std::vector<struct epoll_event> events(ports.size() > 0 ? ports.size() : 1);
+    std::vector<uint8_t> buffer(4096);
+    size_t running = ports.size();
+    while (running > 0)
+    {
+        Clock::time_point now = Clock::now();
+        Clock::time_point next_deadline = now + std::chrono::milliseconds(timeout_ms);
+        for (Port &port : ports)
+        {
+            if (!port.session->finished() && port.deadline < next_deadline)
+                next_deadline = port.deadline;
+        }
+        int wait_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(next_deadline - now).count();
+
+        int count = epoll_wait(epoll, events.data(), events.size(), std::max(wait_ms, 0) + 1);
+        if (count < 0 && errno != EINTR)
+        {
+            ::close(epoll);
+            throw std::runtime_error(std::string("epoll_wait failed: ") + strerror(errno));
+        }
+
+        for (int e = 0; e < count; e++)
+        {
+            Port &port = ports[events[e].data.u64];
+            FlashSession &session = *port.session;
+            int fd = port.connection->getFd();
+
+            if (events[e].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            {
+                ssize_t n;
+                while ((n = ::read(fd, buffer.data(), buffer.size())) > 0)
+                {
+                    session.receive(buffer.data(), n);
+                    port.deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+                }
+            }
+            while (session.pendingSize() > 0)
+            {
+                ssize_t n = ::write(fd, session.pending(), session.pendingSize());
+                if (n <= 0)
+                    break;
+                session.sent(n);
+                port.deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+            }
+        }
+
+        now = Clock::now();
+        running = 0;
+        for (size_t i = 0; i < ports.size(); i++)
+        {
+            Port &port = ports[i];
+            FlashSession &session = *port.session;
+            if (!port.registered)
+                continue;
+            if (!session.finished() && port.deadline <= now)
+                session.timeout();
+            if (session.finished())
+            {
+                control(EPOLL_CTL_DEL, port.connection->getFd(), nullptr);
+                port.registered = false;
+                continue;
+            }
+            running++;
+
+            // only ask for EPOLLOUT while there is something to send, or epoll never sleeps
+            bool writable = session.pendingSize() > 0;
+            if (writable != port.writable)
+            {
+                struct epoll_event event;
+                event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+                event.data.u64 = i;
+                control(EPOLL_CTL_MOD, port.connection->getFd(), &event);
+                port.writable = writable;
+            }
+        }
+    }
+    ::close(epoll);
+}
+
+enum UringOperation
+{
+    URING_WRITE = 1,
+    URING_READ = 2,
+    URING_TIMEOUT = 3,
+    URING_CANCEL = 4
+};
+
+/// @brief Same loop as runEpoll, but every read, write and timeout is an io_uring request.
+// Each turn of the loop queues, for every port, the pending command and a read linked to a timeout,
+// then submits them all and waits for completions with a single io_uring_enter.
+void FleetFlasher::runUring()
+{
+    struct InFlight
+    {
+        bool write;
+        bool read;
+        bool timeout;
+        bool cancel;
+        struct __kernel_timespec timespec;
+        std::vector<uint8_t> buffer;
+        std::vector<uint8_t> received; // read while the write was in flight
+    };
+
+    IoUring ring(std::max((size_t)8, ports.size() * 4));
+    std::vector<InFlight> flights(ports.size());
+    std::vector<int> flags(ports.size());
+    for (size_t i = 0; i < ports.size(); i++)
+    {
+        // the reads must wait for data in the kernel, timeouts are done by the ring
+        int fd = ports[i].connection->getFd();
+        flags[i] = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags[i] & ~O_NONBLOCK);
+        flights[i] = InFlight{false, false, false, false, {0, 0}, std::vector<uint8_t>(4096), {}};
+        flights[i].timespec.tv_sec = timeout_ms / 1000;
+        flights[i].timespec.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    }
+
+    while (true)
+    {
+        bool busy = false;
+        for (size_t i = 0; i < ports.size(); i++)
+        {
+            FlashSession &session = *ports[i].session;
+            InFlight &flight = flights[i];
+            int fd = ports[i].connection->getFd();
+
+            if (!session.finished() && session.pendingSize() > 0 && !flight.write)
+            {
+                struct io_uring_sqe *sqe = ring.getSqe();
+                sqe->opcode = IORING_OP_WRITE;
+                sqe->fd = fd;
+                sqe->addr = (uint64_t)(uintptr_t)session.pending();
+                sqe->len = session.pendingSize();
+                sqe->off = (uint64_t)-1;
+                sqe->user_data = (i << 8) | URING_WRITE;
+                flight.write = true;
+            }
+            if (!session.finished() && !flight.read && !flight.timeout)
+            {
+                struct io_uring_sqe *sqe = ring.getSqe();
+                sqe->opcode = IORING_OP_READ;
+                sqe->fd = fd;
+                sqe->addr = (uint64_t)(uintptr_t)flight.buffer.data();
+                sqe->len = flight.buffer.size();
+                sqe->off = (uint64_t)-1;
+                sqe->flags = IOSQE_IO_LINK;
+                sqe->user_data = (i << 8) | URING_READ;
+
+                sqe = ring.getSqe();
+                sqe->opcode = IORING_OP_LINK_TIMEOUT;
+                sqe->addr = (uint64_t)(uintptr_t)&flight.timespec;
+                sqe->len = 1;
+                sqe->user_data = (i << 8) | URING_TIMEOUT;
+                flight.read = true;
+                flight.timeout = true;
+            }
+            if (session.finished() && flight.read && !flight.cancel)
+            {
+                struct io_uring_sqe *sqe = ring.getSqe();
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = (i << 8) | URING_READ;
+                sqe->user_data = (i << 8) | URING_CANCEL;
+                flight.cancel = true;
+            }
+            busy = busy || flight.write || flight.read || flight.timeout || flight.cancel;
+        }
+        if (!busy)
+            break;
+
+        ring.submitAndWait(1);
+
+        struct io_uring_cqe cqe;
+        while (ring.popCqe(cqe))
+        {
+            size_t i = cqe.user_data >> 8;
+            FlashSession &session = *ports[i].session;
+            InFlight &flight = flights[i];
+
+            switch (cqe.user_data & 0xFF)
+            {
+            case URING_WRITE:
+                flight.write = false;
+                // the tty write of an io-wq worker can be interrupted, it is queued again on the next turn
+                if (session.finished())
+                    break;
+                if (cqe.res > 0)
+                    session.sent(cqe.res);
+                else if (cqe.res != -EINTR)
+                    session.timeout();
+                if (!flight.received.empty())
+                {
+                    session.receive(flight.received.data(), flight.received.size());
+                    flight.received.clear();
+                }
+                break;
+            case URING_READ:
+                flight.read = false;
+                // the response can start the next command, whose request would replace the one the kernel is
+                // still writing : it waits for the completion of the write
+                if (cqe.res > 0 && flight.write)
+                    flight.received.insert(flight.received.end(), flight.buffer.data(), flight.buffer.data() + cqe.res);
+                else if (cqe.res > 0)
+                    session.receive(flight.buffer.data(), cqe.res);
+                break;
+            case URING_TIMEOUT:
+                flight.timeout = false;
+                if (cqe.res == -ETIME && !session.finished())
+                    session.timeout();
+                break;
+            case URING_CANCEL:
+                flight.cancel = false;
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < ports.size(); i++)
+    {
+        fcntl(ports[i].connection->getFd(), F_SETFL, flags[i]);
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef FLEET_H
+#define FLEET_H
+
+#include "hexfile.h"
+#include "connection.h"
+#include "framer.h"
+
+#include <chrono>
+#include <memory>
+
+/// @brief A full flash of one device, as a non-blocking state machine.
+// The session never touches a file descriptor : it hands out the bytes of the next command (`pending()`),
+// and is fed with whatever arrives (`receive()`). The chunks are shared between all the sessions.
+class FlashSession
+{
+public:
+    enum State
+    {
+        HANDSHAKE_VERSION,
+        HANDSHAKE_RANGE,
+        ERASE,
+        WRITE,
+        CHECKSUM,
+        SELF_VERIFY,
+        DONE,
+        FAILED
+    };
+
+private:
+    std::shared_ptr<const std::vector<Segment>> chunks;
+    BootAttrs bootattrs;
+    size_t chunk_index;
+
+    std::vector<uint8_t> request;
+    size_t request_sent;
+    Command current;
+    ResponseFramer framer;   // bytes which are not the response to `current` are skipped
+    const uint8_t *response; // while handling it
+
+    void send(const Command &command, const uint8_t *data = nullptr, size_t size = 0);
+    void fail(const std::string &reason);
+    void handleResponse();
+    void next();
+
+public:
+    State state;
+    std::string error;
+
+    FlashSession(std::shared_ptr<const std::vector<Segment>> chunks, BootAttrs bootattrs);
+
+    bool finished() const { return state == DONE || state == FAILED; }
+
+    /// @brief bytes of the current command which were not sent yet.
+    const uint8_t *pending() const { return request.data() + request_sent; }
+    size_t pendingSize() const { return request.size() - request_sent; }
+    void sent(size_t size) { request_sent += size; }
+    bool waiting() const { return !finished() && pendingSize() == 0; }
+
+    void receive(const uint8_t *data, size_t size);
+    void timeout();
+};
+
+enum FleetBackend
+{
+    FLEET_EPOLL,   // readiness with epoll, then read() and write() for each port
+    FLEET_IO_URING // reads, writes and their timeouts of every port submitted in one io_uring_enter
+};
+
+/// @brief Flashes many devices at once from a single thread, one FlashSession per serial port, driven by epoll.
+class FleetFlasher
+{
+public:
+    struct Port
+    {
+        std::string path;
+        std::unique_ptr<SerialConnection> connection;
+        std::unique_ptr<FlashSession> session;
+        std::chrono::steady_clock::time_point deadline;
+        bool writable;   // registered for EPOLLOUT
+        bool registered; // in the epoll set, until the session is finished
+    };
+
+private:
+    std::shared_ptr<const std::vector<Segment>> chunks;
+    BootAttrs bootattrs;
+
+    void runEpoll();
+    void runUring();
+
+public:
+    std::vector<Port> ports;
+    int timeout_ms;
+    FleetBackend backend;
+
+    FleetFlasher(std::shared_ptr<const std::vector<Segment>> chunks, BootAttrs bootattrs);
+
+    void add(const std::string &path, unsigned int baudrate);
+
+    /// @brief runs every session until it is done or failed.
+    /// @return the number of sessions which failed, see `ports[i].session->error`.
+    unsigned int run();
+};
+
+#endif /* FLEET_H */
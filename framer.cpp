@@ -0,0 +1,91 @@
+#include "doctest.h"
+
+#include "framer.h"
+
+// echoed header + status
+#define RESPONSE_MIN_SIZE 12
+#define VERSION_RESPONSE_SIZE 37
+
+ResponseFramer::ResponseFramer() : start(0), skipped(0)
+{
+}
+
+size_t ResponseFramer::responseSize(const Packet &request, uint8_t status)
+{
+    if (request.getCommand() == CommandCode::READ_VERSION)
+        return VERSION_RESPONSE_SIZE;
+    if (status != ResponseCode::SUCCESS)
+        return RESPONSE_MIN_SIZE;
+    switch (request.getCommand())
+    {
+    case CommandCode::READ_FLASH:
+        return RESPONSE_MIN_SIZE + request.getDataLength();
+    case CommandCode::CALC_CHECKSUM:
+        return RESPONSE_MIN_SIZE + sizeof(uint16_t);
+    case CommandCode::GET_MEMORY_ADDRESS_RANGE:
+        return RESPONSE_MIN_SIZE + 2 * sizeof(uint32_t);
+    default:
+        return RESPONSE_MIN_SIZE;
+    }
+}
+
+/// @brief whether the bytes available from `position` can be the beginning of the response to `request`.
+bool ResponseFramer::plausible(const Packet &request, size_t position) const
+{
+    std::array<uint8_t, 11> expected = request.toBytes();
+    size_t available = buffer.size() - position;
+    const uint8_t *bytes = buffer.data() + position;
+    for (size_t i = 0; i < expected.size() && i < available; i++)
+    {
+        // command and data length (0 to 2), address (7 to 10) are echoed, the unlock sequence is not checked
+        if ((i < 3 || i >= 7) && bytes[i] != expected[i])
+            return false;
+    }
+    if (request.getCommand() != CommandCode::READ_VERSION && available > expected.size())
+    {
+        uint8_t status = bytes[expected.size()];
+        return status == ResponseCode::SUCCESS || status == ResponseCode::UNSUPPORTED_COMMAND ||
+               status == ResponseCode::BAD_ADDRESS || status == ResponseCode::BAD_LENGTH ||
+               status == ResponseCode::VERIFY_FAIL;
+    }
+    return true;
+}
+
+void ResponseFramer::feed(const uint8_t *data, size_t size)
+{
+    if (start > 0 && start >= buffer.size() / 2)
+    {
+        buffer.erase(buffer.begin(), buffer.begin() + start);
+        start = 0;
+    }
+    buffer.insert(buffer.end(), data, data + size);
+}
+
+size_t ResponseFramer::frame(const Packet &request)
+{
+    size_t position = start;
+    while (position < buffer.size() && !plausible(request, position))
+        position++;
+    skipped += position - start;
+    start = position;
+
+    if (size() < RESPONSE_MIN_SIZE)
+        return 0;
+    size_t total = responseSize(request, buffer[start + RESPONSE_MIN_SIZE - 1]);
+    return size() >= total ? total : 0;
+}
+
+size_t ResponseFramer::missing(const Packet &request) const
+{
+    size_t total = RESPONSE_MIN_SIZE;
+    if (size() >= RESPONSE_MIN_SIZE)
+        total = responseSize(request, buffer[start + RESPONSE_MIN_SIZE - 1]);
+    else if (request.getCommand() == CommandCode::READ_VERSION)
+        total = VERSION_RESPONSE_SIZE;
+    return total > size() ? total - size() : 0;
+}
+
+void ResponseFramer::consume(size_t size)
+{
+    start += std::min(size, this->size());
+}
@@ -0,0 +1,43 @@
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include "hexfile.h"
+
+#include <vector>
+
+/// @brief Cuts the bytes coming from the bootloader into responses, and finds its way back after garbage.
+// Every response starts with the echo of the command header, followed by a status byte (except READ_VERSION).
+// Bytes are only taken as the start of the response when the echoed command, data length and address match
+// the request it answers, and the status is a known ResponseCode. Otherwise they are dropped up to the next
+// position where the response could start : a stray byte on the line costs one scan, not one timeout.
+// The echo of READ_VERSION is all zeros and has no status, so zeros just before it cannot be told apart.
+class ResponseFramer
+{
+private:
+    std::vector<uint8_t> buffer;
+    size_t start;
+
+    bool plausible(const Packet &request, size_t position) const;
+
+public:
+    size_t skipped; // bytes dropped since the creation of the framer
+
+    ResponseFramer();
+
+    /// @brief total size of the response to `request` when it carries `status`.
+    static size_t responseSize(const Packet &request, uint8_t status);
+
+    void feed(const uint8_t *data, size_t size);
+
+    /// @brief size of the response to `request` at the head of the buffer, once complete, otherwise 0.
+    // Leading bytes which cannot start that response are dropped first.
+    size_t frame(const Packet &request);
+    /// @brief lower bound of the number of bytes still needed to complete the response to `request`.
+    size_t missing(const Packet &request) const;
+
+    const uint8_t *data() const { return buffer.data() + start; }
+    size_t size() const { return buffer.size() - start; }
+    void consume(size_t size);
+};
+
+#endif /* FRAMER_H */
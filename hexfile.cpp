@@ -6,7 +6,15 @@
 
 #include <stdexcept>
 #include "hexfile.h"
+#include "chunker.h"
 #include <algorithm> //std::remove
+#include <cstdio>
+#include <cstring>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 std::vector<uint8_t> hexStringToBytes(const std::string &str)
 {
@@ -254,6 +262,45 @@ unsigned int HexFile::totalLength() const
     return length;
 }
 
+/// @brief index of the first segment which ends after `address`, `segments.size()` if there is none.
+static size_t segmentAfter(const std::vector<Segment> &segments, unsigned int address)
+{
+    auto found = std::upper_bound(segments.begin(), segments.end(), address,
+                                  [](unsigned int address, const Segment &segment)
+                                  { return address < segment.minimum_address + segment.data.size(); });
+    return found - segments.begin();
+}
+
+size_t HexFile::read(unsigned int address, size_t length, uint8_t *out, uint8_t padding) const
+{
+    size_t found = 0;
+    size_t offset = 0;
+    for (size_t i = segmentAfter(segments, address); offset < length && i < segments.size(); i++)
+    {
+        const Segment &segment = segments[i];
+        if (segment.minimum_address >= address + length)
+            break;
+        // the gap before the segment, then the data of the segment within the range
+        size_t start = std::max((size_t)segment.minimum_address, (size_t)address) - address;
+        memset(out + offset, padding, start - offset);
+        size_t end = std::min((size_t)segment.minimum_address + segment.data.size(), (size_t)address + length) - address;
+        memcpy(out + start, segment.data.data() + (address + start - segment.minimum_address), end - start);
+        found += end - start;
+        offset = end;
+    }
+    memset(out + offset, padding, length - offset);
+    return found;
+}
+
+const uint8_t *HexFile::view(unsigned int address, size_t length) const
+{
+    size_t i = segmentAfter(segments, address);
+    if (i == segments.size() || segments[i].minimum_address > address ||
+        (size_t)address + length > segments[i].minimum_address + segments[i].data.size())
+        return nullptr;
+    return segments[i].data.data() + (address - segments[i].minimum_address);
+}
+
 /// @brief Keep given range and discard the rest.
 /// @param minimum_address is the first word address to keep (including)
 /// @param maximum_address is the last word address to keep (excluding).
@@ -326,7 +373,7 @@ std::string strip(const std::string &str)
     return str.substr(start, end - start);
 }
 
-std::vector<Segment> HexFile::chunked(std::string hexfile, BootAttrs bootattrs)
+bool HexFile::load(const std::string &hexfile)
 {
     std::ifstream file(hexfile);
     std::string line;
@@ -340,7 +387,7 @@ std::vector<Segment> HexFile::chunked(std::string hexfile, BootAttrs bootattrs)
     else
     {
         std::cout << "file is NOT open" << std::endl;
-        return std::vector<Segment>();
+        return false;
     }
 
     word_size_bytes = 1;
@@ -372,7 +419,20 @@ std::vector<Segment> HexFile::chunked(std::string hexfile, BootAttrs bootattrs)
     {
         segments[i].word_size_bytes = 2;
     }
+    return true;
+}
+
+std::vector<Segment> HexFile::chunked(std::string hexfile, BootAttrs bootattrs)
+{
+    if (!load(hexfile))
+    {
+        return std::vector<Segment>();
+    }
+    return chunked(bootattrs);
+}
 
+std::vector<Segment> HexFile::chunked(BootAttrs bootattrs)
+{
     crop(bootattrs.memory_start, bootattrs.memory_end);
     // std::cout << "at this point after crop, I have " << debug_segments_before_crop.size() << " segments in debug_segments_before_crop" << std::endl;
 
@@ -396,6 +456,11 @@ std::vector<Segment> HexFile::chunked(std::string hexfile, BootAttrs bootattrs)
 
     // std::cout << "chunk_size : " << chunk_size << std::endl;
     // std::cout << "align : " << align << std::endl;
+    SegmentsChunker specialized = chunkerFor(word_size_bytes, bootattrs.write_size);
+    if (specialized != nullptr)
+    {
+        return specialized(segments, chunk_size, twoBytes);
+    }
     res = chunks(chunk_size, align, twoBytes);
     return res;
 }
@@ -457,3 +522,290 @@ std::vector<Segment> HexFile::chunks(unsigned int size, unsigned int alignment,
 
     return result;
 }
+
+/// @brief Add given data at given byte address, like bincopy's add_binary.
+void HexFile::add_binary(const std::vector<uint8_t> &data, unsigned int address)
+{
+    if (word_size_bytes == 0)
+    {
+        word_size_bytes = 1;
+    }
+    if (data.empty())
+    {
+        return;
+    }
+    addSegment(Segment(address, address + data.size(), data, word_size_bytes));
+}
+
+void encodeHex(const uint8_t *data, size_t size, char *out)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    size_t i = 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // 4 bytes at a time in a 64 bits word : each byte is spread over 16 bits, one nibble per byte in the order
+    // they are printed, then every nibble is turned into its digit at once ('A' - '0' - 10 == 7).
+    for (; i + 4 <= size; i += 4)
+    {
+        uint32_t bytes;
+        memcpy(&bytes, data + i, sizeof(bytes));
+        uint64_t spread = bytes;
+        spread = (spread | (spread << 16)) & 0x0000FFFF0000FFFFull;
+        spread = (spread | (spread << 8)) & 0x00FF00FF00FF00FFull;
+        uint64_t nibbles = ((spread >> 4) & 0x000F000F000F000Full) | ((spread & 0x000F000F000F000Full) << 8);
+        uint64_t letters = ((nibbles + 0x0606060606060606ull) >> 4) & 0x0101010101010101ull;
+        uint64_t text = nibbles + 0x3030303030303030ull + letters * 7;
+        memcpy(out + 2 * i, &text, sizeof(text));
+    }
+#endif
+    for (; i < size; i++)
+    {
+        out[2 * i] = digits[data[i] >> 4];
+        out[2 * i + 1] = digits[data[i] & 0xf];
+    }
+}
+
+/// @brief writes one record, with its checksum and end of line, and returns the end of what was written.
+static char *pack_ihex(char *out, unsigned int type_, unsigned int address, const uint8_t *data, unsigned int size)
+{
+    uint8_t header[4] = {(uint8_t)size, (uint8_t)(address >> 8), (uint8_t)address, (uint8_t)type_};
+    unsigned int crc = header[0] + header[1] + header[2] + header[3];
+    for (unsigned int i = 0; i < size; i++)
+        crc += data[i];
+    uint8_t checksum = (~crc + 1) & 0xff;
+
+    *out++ = ':';
+    encodeHex(header, sizeof(header), out);
+    out += 2 * sizeof(header);
+    encodeHex(data, size, out);
+    out += 2 * size;
+    encodeHex(&checksum, 1, out);
+    out += 2;
+    *out++ = '\n';
+    return out;
+}
+
+/// @brief size of a record holding `size` data bytes.
+static size_t ihexRecordSize(unsigned int size)
+{
+    return 1 + 2 * (4 + size + 1) + 1;
+}
+
+/// @brief calls `emit(type, address, data, size)` for every record of the `as_ihex` output, in order.
+template <typename Emit>
+static void forEachIhexRecord(const std::vector<Segment> &segments, unsigned int number_of_data_bytes,
+                              unsigned int address_length_bits, Emit emit)
+{
+    if (number_of_data_bytes == 0 || number_of_data_bytes > 255)
+    {
+        throw std::invalid_argument("records hold 1 to 255 data bytes");
+    }
+    if (address_length_bits != 16 && address_length_bits != 24 && address_length_bits != 32)
+    {
+        throw std::invalid_argument("address length must be 16, 24 or 32 bits");
+    }
+
+    unsigned int extended = 0; // given by the last 02 (in paragraphs) or 04 (upper 16 bits) record
+    for (const Segment &segment : segments)
+    {
+        for (size_t offset = 0; offset < segment.data.size(); offset += number_of_data_bytes)
+        {
+            unsigned int address = segment.minimum_address + offset;
+            // bincopy chunks are aligned on the record size
+            unsigned int size = std::min((size_t)(number_of_data_bytes - address % number_of_data_bytes),
+                                         segment.data.size() - offset);
+            if (address_length_bits == 32)
+            {
+                if ((address >> 16) > extended)
+                {
+                    extended = address >> 16;
+                    uint8_t upper[2] = {(uint8_t)(extended >> 8), (uint8_t)extended};
+                    emit(IHEX_EXTENDED_LINEAR_ADDRESS, 0, upper, 2);
+                }
+                address &= 0xffff;
+            }
+            else if (address_length_bits == 24)
+            {
+                if (address > extended * 16 + 0xffff)
+                {
+                    extended = std::min((address & 0xffff0000) >> 4, 0xffffu);
+                    uint8_t segment_address[2] = {(uint8_t)(extended >> 8), (uint8_t)extended};
+                    emit(IHEX_EXTENDED_SEGMENT_ADDRESS, 0, segment_address, 2);
+                }
+                address -= extended * 16;
+            }
+            if (address_length_bits != 32 && address <= 0xffff)
+            {
+                // with 02 records or none, the offset wraps within 64 KiB : a record cannot cross 0x10000
+                size = std::min(size, 0x10000 - address);
+            }
+            if (address > 0xffff)
+            {
+                throw std::runtime_error("address 0x" + bytesToHexString({(uint8_t)(address >> 24), (uint8_t)(address >> 16),
+                                                                          (uint8_t)(address >> 8), (uint8_t)address}) +
+                                         " does not fit in " + std::to_string(address_length_bits) + " bits HEX records");
+            }
+            emit(IHEX_DATA, address, segment.data.data() + offset, size);
+            offset -= number_of_data_bytes - size;
+        }
+    }
+    emit(IHEX_END_OF_FILE, 0, nullptr, 0);
+}
+
+size_t HexFile::ihex_size(unsigned int number_of_data_bytes, unsigned int address_length_bits) const
+{
+    size_t size = 0;
+    forEachIhexRecord(segments, number_of_data_bytes, address_length_bits,
+                      [&](unsigned int, unsigned int, const uint8_t *, unsigned int record_size)
+                      { size += ihexRecordSize(record_size); });
+    return size;
+}
+
+size_t HexFile::write_ihex(char *out, unsigned int number_of_data_bytes, unsigned int address_length_bits) const
+{
+    char *end = out;
+    forEachIhexRecord(segments, number_of_data_bytes, address_length_bits,
+                      [&](unsigned int type_, unsigned int address, const uint8_t *data, unsigned int size)
+                      { end = pack_ihex(end, type_, address, data, size); });
+    return end - out;
+}
+
+/// @brief Format the segments as Intel HEX records, same output as bincopy's as_ihex.
+std::string HexFile::as_ihex(unsigned int number_of_data_bytes, unsigned int address_length_bits) const
+{
+    std::string result(ihex_size(number_of_data_bytes, address_length_bits), '\0');
+    write_ihex(&result[0], number_of_data_bytes, address_length_bits);
+    return result;
+}
+
+void HexFile::save_ihex(const std::string &path, unsigned int number_of_data_bytes, unsigned int address_length_bits) const
+{
+    size_t size = ihex_size(number_of_data_bytes, address_length_bits);
+    std::string temporary = path + ".tmp";
+    int fd = ::open(temporary.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot create HEX file " + temporary + ": " + strerror(errno));
+    }
+    void *mapping = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    bool written = mapping != MAP_FAILED;
+    if (written)
+    {
+        write_ihex(static_cast<char *>(mapping), number_of_data_bytes, address_length_bits);
+        written = munmap(mapping, size) == 0 && fsync(fd) == 0;
+    }
+    written = (::close(fd) == 0) && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::string reason = strerror(errno);
+        unlink(temporary.c_str());
+        throw std::runtime_error("cannot write HEX file " + path + ": " + reason);
+    }
+}
+
+HexFile HexFile::merge(const std::vector<const HexFile *> &files, MergePolicy policy)
+{
+    HexFile merged;
+    for (const HexFile *file : files)
+    {
+        if (file->word_size_bytes != 0 && merged.word_size_bytes != 0 && file->word_size_bytes != merged.word_size_bytes)
+        {
+            throw std::invalid_argument("cannot merge HEX files with different word sizes");
+        }
+        if (file->word_size_bytes != 0)
+            merged.word_size_bytes = file->word_size_bytes;
+    }
+
+    // for each file, its next segment, and whether the sweep is inside it
+    std::vector<size_t> next(files.size(), 0);
+    std::vector<bool> inside(files.size(), false);
+    unsigned int position = 0;
+    while (true)
+    {
+        // enter or leave the segments which start or end here, then find the next boundary
+        bool more = false;
+        unsigned int boundary = 0;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            const std::vector<Segment> &segments = files[i]->segments;
+            while (next[i] < segments.size())
+            {
+                const Segment &segment = segments[next[i]];
+                unsigned int end = segment.minimum_address + segment.data.size();
+                if (inside[i] && end == position)
+                {
+                    inside[i] = false;
+                    next[i]++;
+                }
+                else if (!inside[i] && segment.minimum_address == position && end > position)
+                {
+                    inside[i] = true;
+                }
+                else if (!inside[i] && end <= position)
+                {
+                    next[i]++; // empty
+                }
+                else
+                {
+                    unsigned int candidate = inside[i] ? end : segment.minimum_address;
+                    boundary = more ? std::min(boundary, candidate) : candidate;
+                    more = true;
+                    break;
+                }
+            }
+        }
+        if (!more)
+            break;
+
+        // the files with data in [position, boundary)
+        int winner = -1;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (!inside[i])
+                continue;
+            if (winner >= 0 && policy == MERGE_ERROR)
+            {
+                throw std::runtime_error("HEX files overlap at address " + std::to_string(position));
+            }
+            if (winner < 0 || policy == MERGE_LAST_WINS)
+                winner = i;
+        }
+        if (winner >= 0)
+        {
+            const Segment &segment = files[winner]->segments[next[winner]];
+            const uint8_t *data = segment.data.data() + (position - segment.minimum_address);
+            if (!merged.segments.empty() && merged.segments.back().maximum_address == position)
+            {
+                Segment &last = merged.segments.back();
+                last.data.insert(last.data.end(), data, data + (boundary - position));
+                last.maximum_address = boundary;
+            }
+            else
+            {
+                merged.segments.push_back(Segment(position, boundary, std::vector<uint8_t>(data, data + (boundary - position)),
+                                                  merged.word_size_bytes));
+            }
+        }
+        position = boundary;
+    }
+    merged.current_segment_index = (int)merged.segments.size() - 1;
+    return merged;
+}
+
+/// @brief All data from the first to the last segment, gaps filled with `padding`.
+std::vector<uint8_t> HexFile::as_binary(uint8_t padding)
+{
+    std::vector<uint8_t> binary;
+    if (segments.empty())
+    {
+        return binary;
+    }
+    unsigned int minimum_address = segments.front().minimum_address;
+    binary.resize(segments.back().maximum_address - minimum_address, padding);
+    for (const Segment &segment : segments)
+    {
+        std::copy(segment.data.begin(), segment.data.end(), binary.begin() + (segment.minimum_address - minimum_address));
+    }
+    return binary;
+}
@@ -15,6 +15,16 @@
 
 std::string bytesToHexString(const std::vector<uint8_t> &bytes);
 std::vector<uint8_t> hexStringToBytes(const std::string &str);
+/// @brief writes `size` bytes to `out` as `2 * size` uppercase hex digits, without separator nor terminator.
+void encodeHex(const uint8_t *data, size_t size, char *out);
+
+/// @brief What `HexFile::merge` does with an address found in several files.
+enum MergePolicy
+{
+    MERGE_ERROR,      // throws std::runtime_error
+    MERGE_FIRST_WINS, // keeps the byte of the file which comes first in the list
+    MERGE_LAST_WINS   // keeps the byte of the file which comes last, like bincopy with overwrite
+};
 
 struct Chunk
 {
@@ -59,11 +69,46 @@ public:
 
     std::vector<Segment> chunked(std::string hexfile, BootAttrs bootattrs);
 
+    /// @brief first half of `chunked` : parses the HEX file, which does not need the BootAttrs.
+    /// @return false if the file cannot be opened.
+    bool load(const std::string &hexfile);
+    /// @brief second half of `chunked`, once the file is loaded : crops to program memory and chunks.
+    std::vector<Segment> chunked(BootAttrs bootattrs);
+
     std::vector<Segment> chunks(unsigned int size, unsigned int alignment, std::vector<uint8_t> padding);
 
     void add_ihex(std::vector<std::string> records);
+    void add_binary(const std::vector<uint8_t> &data, unsigned int address);
+
+    /// @brief the segments as Intel HEX records of at most `number_of_data_bytes` bytes, like bincopy's as_ihex.
+    // With `address_length_bits` 32, addresses above 64 KiB are given by extended linear address (04) records,
+    // with 24 by extended segment address (02) records (up to 1 MiB), and 16 allows no address above 64 KiB.
+    // With 24 and 16 bits, a record never crosses a 64 KiB boundary, where the record offset wraps.
+    std::string as_ihex(unsigned int number_of_data_bytes = 32, unsigned int address_length_bits = 32) const;
+    /// @brief size of the `as_ihex` output, in bytes.
+    size_t ihex_size(unsigned int number_of_data_bytes = 32, unsigned int address_length_bits = 32) const;
+    /// @brief writes the `as_ihex` output to `out`, which must hold `ihex_size` bytes.
+    /// @return the number of bytes written.
+    size_t write_ihex(char *out, unsigned int number_of_data_bytes = 32, unsigned int address_length_bits = 32) const;
+    /// @brief writes the `as_ihex` output to `path`, directly in a mapping of the file.
+    // Written next to `path`, synced, then renamed, so the file is either complete or absent.
+    void save_ihex(const std::string &path, unsigned int number_of_data_bytes = 32, unsigned int address_length_bits = 32) const;
+    std::vector<uint8_t> as_binary(uint8_t padding = 0xff);
 
     unsigned int totalLength() const;
+
+    /// @brief copies the `length` bytes from `address` (in bytes, like the segments) to `out`, `padding` where there is no data.
+    /// @return the number of bytes which come from the image, not from the padding.
+    // The segments are found by binary search, so a read costs O(log n) for n segments, plus the copy.
+    size_t read(unsigned int address, size_t length, uint8_t *out, uint8_t padding = 0xff) const;
+    /// @brief the `length` bytes from `address`, without copy, if they are all in one segment; nullptr otherwise.
+    // The pointer is valid until the segments change.
+    const uint8_t *view(unsigned int address, size_t length) const;
+
+    /// @brief one image with the data of all `files` (for instance bootloader, application and configuration).
+    // The sorted segment lists are swept once together, from one segment boundary to the next : the cost is
+    // linear in the number of bytes. Adjacent data ends up in one segment, whichever file it comes from.
+    static HexFile merge(const std::vector<const HexFile *> &files, MergePolicy policy = MERGE_ERROR);
 };
 
 #endif /* HEXFILE_H */
@@ -0,0 +1,122 @@
+#include "doctest.h"
+
+#include "journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ProgressJournal::ProgressJournal(const std::string &path)
+    : fd(-1), path(path), image_id(0), erased_all(false)
+{
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot open progress journal " + path + ": " + strerror(errno));
+    }
+
+    JournalRecord record;
+    off_t complete = 0;
+    while (pread(fd, &record, sizeof(record), complete) == (ssize_t)sizeof(record))
+    {
+        complete += sizeof(record);
+        if (record.event == JOURNAL_IMAGE)
+        {
+            image_id = record.value;
+            erased_all = false;
+            pages.clear();
+        }
+        else if (record.event == JOURNAL_ERASED_ALL)
+        {
+            erased_all = true;
+        }
+        else
+        {
+            pages[record.value] = static_cast<JournalEvent>(record.event);
+        }
+    }
+    // drops a record torn by the interruption, so that the next ones are aligned
+    if (ftruncate(fd, complete) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("cannot repair progress journal " + path + ": " + strerror(errno));
+    }
+}
+
+ProgressJournal::~ProgressJournal()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+uint32_t ProgressJournal::imageId(const FlashPages &image)
+{
+    uint32_t hash = 2166136261u;
+    for (const Page &page : image.pages)
+    {
+        for (const Segment &chunk : page.chunks)
+        {
+            uint32_t address = chunk.address();
+            const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&address);
+            for (size_t i = 0; i < sizeof(address); i++)
+                hash = (hash ^ bytes[i]) * 16777619u;
+            for (uint8_t byte : chunk.data)
+                hash = (hash ^ byte) * 16777619u;
+        }
+    }
+    return hash != 0 ? hash : 1;
+}
+
+void ProgressJournal::append(JournalEvent event, uint32_t value)
+{
+    JournalRecord record;
+    memset(&record, 0, sizeof(record));
+    record.event = event;
+    record.value = value;
+    if (::write(fd, &record, sizeof(record)) != (ssize_t)sizeof(record) || fdatasync(fd) != 0)
+    {
+        throw std::runtime_error("cannot write progress journal " + path + ": " + strerror(errno));
+    }
+}
+
+void ProgressJournal::start(uint32_t id)
+{
+    if (ftruncate(fd, 0) != 0)
+    {
+        throw std::runtime_error("cannot reset progress journal " + path + ": " + strerror(errno));
+    }
+    image_id = id;
+    erased_all = false;
+    pages.clear();
+    append(JOURNAL_IMAGE, id);
+}
+
+void ProgressJournal::record(JournalEvent event, unsigned int address)
+{
+    append(event, address);
+    if (event == JOURNAL_ERASED_ALL)
+        erased_all = true;
+    else
+        pages[address] = event;
+}
+
+JournalEvent ProgressJournal::state(unsigned int address) const
+{
+    std::map<unsigned int, JournalEvent>::const_iterator found = pages.find(address);
+    return found == pages.end() ? static_cast<JournalEvent>(0) : found->second;
+}
+
+void ProgressJournal::finish()
+{
+    if (ftruncate(fd, 0) != 0 || unlink(path.c_str()) != 0)
+    {
+        throw std::runtime_error("cannot remove progress journal " + path + ": " + strerror(errno));
+    }
+    image_id = 0;
+    erased_all = false;
+    pages.clear();
+}
@@ -0,0 +1,60 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "flashpages.h"
+
+#include <map>
+#include <string>
+
+enum JournalEvent
+{
+    JOURNAL_IMAGE = 1,      // value : image id, starts the journal of one update
+    JOURNAL_ERASED_ALL = 2, // the whole program memory was erased
+    JOURNAL_ERASED = 3,     // value : word address of an erased page
+    JOURNAL_WRITTEN = 4,    // value : word address of a page whose chunks were all written
+    JOURNAL_VERIFIED = 5    // value : word address of a page whose checksum matched the image
+};
+
+struct JournalRecord
+{
+    uint8_t event;
+    uint8_t reserved[3];
+    uint32_t value;
+};
+
+/// @brief Append-only record of the progress of an update, synced to disk after every record.
+// If the update is interrupted (power loss, USB link dropped), the next run reads back how far it went :
+// the last state reached by each page. A record cut in the middle by the interruption is dropped.
+class ProgressJournal
+{
+private:
+    int fd;
+    std::string path;
+
+    void append(JournalEvent event, uint32_t value);
+
+public:
+    uint32_t image_id; // 0 when the journal is empty
+    bool erased_all;
+    std::map<unsigned int, JournalEvent> pages; // page word address -> last event
+
+    /// @brief opens (or creates) the journal in `path`, and reads back the records already there.
+    explicit ProgressJournal(const std::string &path);
+    ~ProgressJournal();
+
+    ProgressJournal(const ProgressJournal &) = delete;
+    ProgressJournal &operator=(const ProgressJournal &) = delete;
+
+    /// @brief identifies an image by its pages : address and content (FNV-1a).
+    static uint32_t imageId(const FlashPages &image);
+
+    /// @brief empties the journal and starts the one of the update to `image_id`.
+    void start(uint32_t image_id);
+    void record(JournalEvent event, unsigned int address = 0);
+    /// @brief last event of the page at `address`, 0 if none.
+    JournalEvent state(unsigned int address) const;
+    /// @brief the update is complete, the journal file is removed.
+    void finish();
+};
+
+#endif /* JOURNAL_H */
@@ -102,6 +102,10 @@ public:
     {
         return sizeof(uint8_t) + sizeof(uint16_t) + 2 * sizeof(uint32_t);
     }
+    uint8_t getCommand() const { return command; }
+    uint16_t getDataLength() const { return data_length; }
+    uint32_t getUnlockSequence() const { return unlock_sequence; }
+    uint32_t getAddress() const { return address; }
 };
 
 TEST_CASE("Packet class creation, fromBytes, toBytes")
@@ -179,6 +183,11 @@ public:
     {
         return ResponseBase::getSize() + 26; // il y a des octets ignorés
     }
+    uint16_t getVersion() const { return version; }
+    uint16_t getMaxPacketLength() const { return max_packet_length; }
+    uint16_t getDeviceId() const { return device_id; }
+    uint16_t getEraseSize() const { return erase_size; }
+    uint16_t getWriteSize() const { return write_size; }
 };
 
 TEST_CASE("Version class getSize ?")
@@ -227,8 +236,9 @@ public:
 
     static size_t getSize()
     {
-        return Packet::getSize() + sizeof(ResponseCode);
+        return Packet::getSize() + sizeof(uint8_t);
     }
+    ResponseCode getSuccess() const { return success; }
 };
 
 TEST_CASE("Response class BAD_LENGTH")
@@ -370,6 +380,7 @@ public:
     {
         return Response::getSize() + sizeof(checksum);
     }
+    uint16_t getChecksum() const { return checksum; }
 };
 
 TEST_CASE("Checksum class is 42")
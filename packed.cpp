@@ -0,0 +1,64 @@
+#include "doctest.h"
+
+#include "packed.h"
+
+PackedImage::PackedImage(const std::vector<Segment> &chunks) : word_size_bytes(chunks.empty() ? 2 : chunks[0].word_size_bytes)
+{
+    size_t bytes = 0;
+    for (const Segment &chunk : chunks)
+    {
+        if (chunk.data.size() % 4 != 0)
+        {
+            throw std::invalid_argument("chunk at address " + std::to_string(chunk.minimum_address) +
+                                        " does not hold whole instructions");
+        }
+        bytes += chunk.data.size() / 4 * 3;
+    }
+    packed.resize(bytes);
+    entries.reserve(chunks.size());
+
+    uint8_t *out = packed.data();
+    for (const Segment &chunk : chunks)
+    {
+        unsigned int instructions = chunk.data.size() / 4;
+        entries.push_back(Entry{chunk.minimum_address, chunk.maximum_address, (size_t)(out - packed.data()), instructions});
+        const uint8_t *in = chunk.data.data();
+        for (unsigned int i = 0; i < instructions; i++, in += 4, out += 3)
+        {
+            out[0] = in[0];
+            out[1] = in[1];
+            out[2] = in[2];
+        }
+    }
+}
+
+void PackedImage::expand(size_t index, Segment &out) const
+{
+    const Entry &entry = entries.at(index);
+    out.minimum_address = entry.minimum_address;
+    out.maximum_address = entry.maximum_address;
+    out.word_size_bytes = word_size_bytes;
+    out.data.resize(entry.instructions * 4);
+
+    const uint8_t *in = packed.data() + entry.offset;
+    uint8_t *data = out.data.data();
+    for (unsigned int i = 0; i < entry.instructions; i++, in += 3, data += 4)
+    {
+        data[0] = in[0];
+        data[1] = in[1];
+        data[2] = in[2];
+        data[3] = 0;
+    }
+}
+
+unsigned int PackedImage::checksum(size_t index) const
+{
+    const Entry &entry = entries.at(index);
+    const uint8_t *in = packed.data() + entry.offset;
+    unsigned int checksum = 0;
+    for (unsigned int i = 0; i < entry.instructions; i++, in += 3)
+    {
+        checksum += in[0] + (in[1] << 8) + in[2];
+    }
+    return checksum;
+}
@@ -0,0 +1,40 @@
+#ifndef PACKED_H
+#define PACKED_H
+
+#include "hexfile.h"
+
+/// @brief Chunks of an image (as returned by `HexFile::chunked`) kept with 3 bytes per instruction.
+// In the HEX file every 24 bits instruction takes 4 bytes, the last one being the phantom byte, which does not
+// exist in flash : the bootloader ignores it, and reads it back as 0x00. It is dropped here, so an image takes
+// a quarter less memory, and all the chunks share one buffer. A chunk is expanded back to 4 bytes per instruction
+// (phantom byte 0x00) only to be written; its checksum is computed from the packed bytes.
+class PackedImage
+{
+private:
+    struct Entry
+    {
+        unsigned int minimum_address; // as in the Segment, in bytes of the HEX file
+        unsigned int maximum_address;
+        size_t offset;                // in `packed`
+        unsigned int instructions;
+    };
+    std::vector<Entry> entries;
+    std::vector<uint8_t> packed;
+    unsigned int word_size_bytes;
+
+public:
+    /// @brief packs the chunks, whose sizes must be whole instructions (4 bytes).
+    explicit PackedImage(const std::vector<Segment> &chunks);
+
+    size_t size() const { return entries.size(); }
+    /// @brief bytes of image data held, without the bookkeeping.
+    size_t packedBytes() const { return packed.size(); }
+
+    /// @brief chunk `index` as `HexFile::chunked` gave it, but with 0x00 phantom bytes.
+    // `out` is reused : once its data has grown to the largest chunk, no more allocation is made.
+    void expand(size_t index, Segment &out) const;
+    /// @brief same as `localChecksum` on the expanded chunk.
+    unsigned int checksum(size_t index) const;
+};
+
+#endif /* PACKED_H */
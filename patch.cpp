@@ -0,0 +1,81 @@
+#include "doctest.h"
+
+#include "patch.h"
+#include "bootloader.h"
+
+#include <algorithm>
+
+PatchedImage::PatchedImage(std::shared_ptr<const std::vector<Segment>> chunks) : chunks(chunks)
+{
+    std::vector<unsigned int> sums;
+    sums.reserve(chunks->size());
+    for (const Segment &chunk : *chunks)
+        sums.push_back(localChecksum(chunk.data));
+    checksums = std::make_shared<const std::vector<unsigned int>>(std::move(sums));
+}
+
+/// @brief index of the chunk holding `address`, `size()` if there is none.
+size_t PatchedImage::find(unsigned int address) const
+{
+    // the chunks are sorted and do not overlap : the candidate is the last one starting at or before `address`
+    auto after = std::upper_bound(chunks->begin(), chunks->end(), address,
+                                  [](unsigned int address, const Segment &chunk) { return address < chunk.minimum_address; });
+    if (after == chunks->begin())
+        return size();
+    const Segment &chunk = *(after - 1);
+    if (address - chunk.minimum_address >= chunk.data.size())
+        return size();
+    return after - 1 - chunks->begin();
+}
+
+void PatchedImage::patch(unsigned int address, const std::vector<uint8_t> &data)
+{
+    // the whole range is checked before anything changes
+    std::vector<size_t> touched;
+    for (size_t i = 0; i < data.size();)
+    {
+        size_t index = find(address + i);
+        if (index == size())
+        {
+            throw std::invalid_argument("address " + std::to_string(address + i) + " is not in the image");
+        }
+        const Segment &chunk = (*chunks)[index];
+        i += chunk.minimum_address + chunk.data.size() - (address + i);
+        touched.push_back(index);
+    }
+
+    size_t i = 0;
+    Segment expanded(0, 0, {}, 2);
+    for (size_t index : touched)
+    {
+        const Segment &chunk = (*chunks)[index];
+        std::map<unsigned int, uint8_t> &bytes = patches[index];
+        for (unsigned int offset = address + i - chunk.minimum_address; offset < chunk.data.size() && i < data.size(); offset++, i++)
+            bytes[offset] = data[i];
+        expand(index, expanded);
+        patched_checksums[index] = localChecksum(expanded.data);
+    }
+}
+
+void PatchedImage::expand(size_t index, Segment &out) const
+{
+    const Segment &chunk = chunks->at(index);
+    out.minimum_address = chunk.minimum_address;
+    out.maximum_address = chunk.maximum_address;
+    out.word_size_bytes = chunk.word_size_bytes;
+    out.data.assign(chunk.data.begin(), chunk.data.end());
+
+    auto patched = patches.find(index);
+    if (patched == patches.end())
+        return;
+    for (const auto &byte : patched->second)
+        out.data[byte.first] = byte.second;
+}
+
+unsigned int PatchedImage::checksum(size_t index) const
+{
+    auto patched = patched_checksums.find(index);
+    if (patched != patched_checksums.end())
+        return patched->second;
+    return checksums->at(index);
+}
@@ -0,0 +1,46 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include "hexfile.h"
+
+#include <map>
+#include <memory>
+
+/// @brief Chunks of a shared image (as returned by `HexFile::chunked`) with a few bytes changed for one device.
+// At the factory every board gets the same image, but for its serial number, calibration or MAC address.
+// The chunks and their checksums are computed once and shared by all the copies; a copy only holds its own
+// patches, and the checksums of the chunks they fall in. Make one PatchedImage of the image, then copy it
+// for each device and `patch` the copy :
+//     PatchedImage image(chunks);
+//     PatchedImage device = image;
+//     device.patch(SERIAL_ADDRESS, serial);
+class PatchedImage
+{
+private:
+    std::shared_ptr<const std::vector<Segment>> chunks;
+    std::shared_ptr<const std::vector<unsigned int>> checksums; // of the shared chunks
+    std::map<size_t, std::map<unsigned int, uint8_t>> patches;  // chunk index -> offset in the chunk -> byte
+    std::map<size_t, unsigned int> patched_checksums;
+
+    size_t find(unsigned int address) const;
+
+public:
+    /// @brief the image without patches; the checksums of the chunks are computed here, once.
+    explicit PatchedImage(std::shared_ptr<const std::vector<Segment>> chunks);
+
+    /// @brief replaces the bytes from `address` (in bytes of the HEX file, like the segments) by `data`.
+    // Throws std::invalid_argument if a byte is not in a chunk : a patch cannot add data to the image.
+    // Only the checksums of the chunks which are patched are computed again.
+    void patch(unsigned int address, const std::vector<uint8_t> &data);
+
+    size_t size() const { return chunks->size(); }
+    /// @brief number of chunks which differ from the shared image.
+    size_t patchedChunks() const { return patches.size(); }
+
+    /// @brief chunk `index` of the shared image, with the patches of this copy, like `PackedImage::expand`.
+    void expand(size_t index, Segment &out) const;
+    /// @brief the shared checksum, or the one `patch` computed again if the chunk is patched.
+    unsigned int checksum(size_t index) const;
+};
+
+#endif /* PATCH_H */
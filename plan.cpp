@@ -0,0 +1,174 @@
+#include "doctest.h"
+
+#include "plan.h"
+#include "bootloader.h"
+#include "flashpages.h"
+#include "journal.h"
+
+#include <cstdio>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static uint32_t fnv1a(const uint8_t *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+FlashPlan::FlashPlan(const std::string &path)
+    : fd(-1), mapped_size(0), mapping(nullptr), header(nullptr), steps(nullptr)
+{
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot open flash plan " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PlanHeader))
+    {
+        ::close(fd);
+        throw std::runtime_error("flash plan " + path + " is truncated");
+    }
+    mapped_size = st.st_size;
+    void *mapped = mmap(nullptr, mapped_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if (mapped == MAP_FAILED)
+    {
+        ::close(fd);
+        throw std::runtime_error("cannot map flash plan " + path + ": " + strerror(errno));
+    }
+    mapping = static_cast<const uint8_t *>(mapped);
+    header = reinterpret_cast<const PlanHeader *>(mapping);
+    steps = reinterpret_cast<const PlanStep *>(mapping + sizeof(PlanHeader));
+
+    // the frames are trusted once the file is known intact : every offset is checked here, once
+    std::string problem;
+    if (memcmp(header->magic, PLAN_MAGIC, sizeof(header->magic)) != 0)
+        problem = "is not a flash plan";
+    else if (sizeof(PlanHeader) + (size_t)header->steps * sizeof(PlanStep) > mapped_size)
+        problem = "is truncated";
+    else if (fnv1a(mapping + sizeof(PlanHeader), mapped_size - sizeof(PlanHeader)) != header->checksum)
+        problem = "is corrupted";
+    for (uint32_t i = 0; problem.empty() && i < header->steps; i++)
+    {
+        if ((size_t)steps[i].request + steps[i].request_size > mapped_size ||
+            (size_t)steps[i].response + steps[i].response_size > mapped_size ||
+            steps[i].request_size < Command::getSize() || steps[i].response_size < Command::getSize())
+            problem = "has a step out of the file";
+    }
+    if (!problem.empty())
+    {
+        munmap(mapped, mapped_size);
+        ::close(fd);
+        throw std::runtime_error("flash plan " + path + " " + problem);
+    }
+}
+
+FlashPlan::~FlashPlan()
+{
+    munmap(const_cast<uint8_t *>(mapping), mapped_size);
+    ::close(fd);
+}
+
+BootAttrs FlashPlan::bootattrs() const
+{
+    BootAttrs bootattrs;
+    bootattrs.version = header->version;
+    bootattrs.max_packet_length = header->max_packet_length;
+    bootattrs.device_id = header->device_id;
+    bootattrs.erase_size = header->erase_size;
+    bootattrs.write_size = header->write_size;
+    bootattrs.memory_start = header->memory_start;
+    bootattrs.memory_end = header->memory_end;
+    bootattrs.has_checksum = header->has_checksum != 0;
+    return bootattrs;
+}
+
+/// @brief appends the frame of `command` and the SUCCESS response expected for it, followed by `result`.
+static void addStep(std::vector<PlanStep> &steps, std::vector<uint8_t> &frames, const Command &command,
+                    const uint8_t *data = nullptr, size_t size = 0, const uint8_t *result = nullptr, size_t result_size = 0)
+{
+    std::array<uint8_t, 11> header = command.toBytes();
+    PlanStep step;
+    step.request = frames.size();
+    step.request_size = header.size() + size;
+    frames.insert(frames.end(), header.begin(), header.end());
+    frames.insert(frames.end(), data, data + size);
+
+    step.response = frames.size();
+    step.response_size = header.size() + 1 + result_size;
+    frames.insert(frames.end(), header.begin(), header.end());
+    frames.push_back(ResponseCode::SUCCESS);
+    frames.insert(frames.end(), result, result + result_size);
+    steps.push_back(step);
+}
+
+void FlashPlan::compile(const std::vector<Segment> &chunks, BootAttrs bootattrs, const std::string &path)
+{
+    std::vector<PlanStep> steps;
+    std::vector<uint8_t> frames;
+
+    unsigned int pages = (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size;
+    addStep(steps, frames, Command(CommandCode::ERASE_FLASH, pages, BOOTLOADER_UNLOCK_SEQUENCE, bootattrs.memory_start));
+    for (const Segment &chunk : chunks)
+    {
+        addStep(steps, frames, Command(CommandCode::WRITE_FLASH, chunk.data.size(), BOOTLOADER_UNLOCK_SEQUENCE, chunk.address()),
+                chunk.data.data(), chunk.data.size());
+        if (bootattrs.has_checksum)
+        {
+            uint16_t checksum = localChecksum(chunk.data) & 0xFFFF;
+            addStep(steps, frames, Command(CommandCode::CALC_CHECKSUM, chunk.data.size(), 0, chunk.address()), nullptr, 0,
+                    reinterpret_cast<const uint8_t *>(&checksum), sizeof(checksum));
+        }
+    }
+    addStep(steps, frames, Command(CommandCode::SELF_VERIFY));
+
+    // offsets were taken within `frames`, which comes after the header and the step table
+    uint32_t base = sizeof(PlanHeader) + steps.size() * sizeof(PlanStep);
+    for (PlanStep &step : steps)
+    {
+        step.request += base;
+        step.response += base;
+    }
+
+    std::vector<uint8_t> body(steps.size() * sizeof(PlanStep));
+    memcpy(body.data(), steps.data(), body.size());
+    body.insert(body.end(), frames.begin(), frames.end());
+
+    PlanHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PLAN_MAGIC, sizeof(header.magic));
+    header.version = bootattrs.version;
+    header.max_packet_length = bootattrs.max_packet_length;
+    header.device_id = bootattrs.device_id;
+    header.erase_size = bootattrs.erase_size;
+    header.write_size = bootattrs.write_size;
+    header.memory_start = bootattrs.memory_start;
+    header.memory_end = bootattrs.memory_end;
+    header.has_checksum = bootattrs.has_checksum;
+    header.image_id = ProgressJournal::imageId(FlashPages(chunks, bootattrs));
+    header.steps = steps.size();
+    header.checksum = fnv1a(body.data(), body.size());
+
+    std::string temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+    {
+        throw std::runtime_error("cannot create flash plan " + temporary + ": " + strerror(errno));
+    }
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                   fwrite(body.data(), 1, body.size(), file) == body.size() &&
+                   fflush(file) == 0 && fsync(fileno(file)) == 0;
+    written = (fclose(file) == 0) && written;
+    if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::string reason = strerror(errno);
+        unlink(temporary.c_str());
+        throw std::runtime_error("cannot write flash plan " + path + ": " + reason);
+    }
+}
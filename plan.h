@@ -0,0 +1,67 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include "hexfile.h"
+
+#include <string>
+
+#define PLAN_MAGIC "MCBPLAN1"
+
+struct PlanHeader
+{
+    char magic[8];
+    uint32_t version; // BootAttrs the plan was compiled for
+    uint32_t max_packet_length;
+    uint32_t device_id;
+    uint32_t erase_size;
+    uint32_t write_size;
+    uint32_t memory_start;
+    uint32_t memory_end;
+    uint32_t has_checksum;
+    uint32_t image_id; // ProgressJournal::imageId of the image
+    uint32_t steps;    // number of PlanStep following the header
+    uint32_t checksum; // FNV-1a of everything after the header
+};
+
+/// @brief One command of the plan : offsets are from the start of the file.
+struct PlanStep
+{
+    uint32_t request;  // command frame, header and data, sent as is
+    uint32_t response; // response expected from the bootloader, byte for byte
+    uint16_t request_size;
+    uint16_t response_size;
+};
+
+/// @brief Commands of `Flasher::flash` for one image and one device, encoded beforehand in a .mcbp file.
+// A plan is compiled once, on a host which has the HEX file, with `compile`. The flasher then maps the file
+// and sends the frames as they are, without parsing, chunking or encoding anything (see `Flasher::flashPlan`).
+// The expected responses hold the local checksums, so checking a chunk is comparing the response with them.
+// File layout : PlanHeader, `steps` PlanStep, then the frames and the expected responses.
+class FlashPlan
+{
+private:
+    int fd;
+    size_t mapped_size;
+    const uint8_t *mapping;
+
+public:
+    const PlanHeader *header;
+    const PlanStep *steps;
+
+    /// @brief maps the plan in `path`, and checks that it is complete and intact.
+    explicit FlashPlan(const std::string &path);
+    ~FlashPlan();
+
+    FlashPlan(const FlashPlan &) = delete;
+    FlashPlan &operator=(const FlashPlan &) = delete;
+
+    /// @brief writes the plan of `Flasher::flash(chunks)` for a device with `bootattrs` to `path`.
+    // Written next to `path`, synced, then renamed, like a snapshot.
+    static void compile(const std::vector<Segment> &chunks, BootAttrs bootattrs, const std::string &path);
+
+    /// @brief the BootAttrs the plan was compiled for.
+    BootAttrs bootattrs() const;
+    const uint8_t *at(uint32_t offset) const { return mapping + offset; }
+};
+
+#endif /* PLAN_H */
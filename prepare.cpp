@@ -0,0 +1,44 @@
+#include "doctest.h"
+
+#include "prepare.h"
+
+#include <chrono>
+#include <future>
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedMs(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+PreparedImage prepareImage(const std::string &hexfile, const std::function<BootAttrs()> &handshake)
+{
+    PreparedImage prepared;
+    HexFile hex;
+    std::future<void> parsed = std::async(std::launch::async, [&]
+                                          {
+        Clock::time_point start = Clock::now();
+        bool loaded = hex.load(hexfile);
+        prepared.parse_ms = elapsedMs(start);
+        if (!loaded)
+        {
+            throw std::runtime_error("cannot open HEX file " + hexfile);
+        } });
+
+    Clock::time_point start = Clock::now();
+    try
+    {
+        prepared.bootattrs = handshake();
+    }
+    catch (...)
+    {
+        parsed.wait();
+        throw;
+    }
+    prepared.handshake_ms = elapsedMs(start);
+
+    parsed.get();
+    prepared.chunks = hex.chunked(prepared.bootattrs);
+    return prepared;
+}
@@ -0,0 +1,24 @@
+#ifndef PREPARE_H
+#define PREPARE_H
+
+#include "hexfile.h"
+
+#include <functional>
+#include <string>
+
+/// @brief An image chunked for the device, and the BootAttrs of the device.
+struct PreparedImage
+{
+    BootAttrs bootattrs;
+    std::vector<Segment> chunks;
+    double parse_ms;     // loading the HEX file, on the worker thread
+    double handshake_ms; // `handshake`, on the calling thread
+};
+
+/// @brief parses `hexfile` on a worker thread while `handshake` runs, then chunks it for the device.
+// `handshake` is typically `[&] { return bootloader.getBootAttrs(); }` : the HEX file does not need the BootAttrs
+// until it is cropped and chunked (`HexFile::load`), so the first write can be sent after the longer of the two
+// instead of their sum. An error of either side is rethrown here, once the worker is done.
+PreparedImage prepareImage(const std::string &hexfile, const std::function<BootAttrs()> &handshake);
+
+#endif /* PREPARE_H */
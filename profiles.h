@@ -0,0 +1,64 @@
+#ifndef PROFILES_H
+#define PROFILES_H
+
+#include "hexfile.h"
+
+#include <stdexcept>
+#include <string>
+
+/// @brief BootAttrs of the parts we flash, as their bootloader reports them, by device id.
+// The memory layout is fixed for each part, so with this table the HEX file can be chunked, a flash plan
+// compiled or checksums computed before the device is attached. Add a part once its handshake was checked
+// against a real board (`matchesDeviceProfile`).
+constexpr BootAttrs DEVICE_PROFILES[] = {
+    // version, max_packet_length, device_id, erase_size, write_size, memory_start, memory_end, has_checksum
+    {258, 256, 13398, 2048, 8, 6144, 174080, true},
+};
+
+constexpr size_t DEVICE_PROFILE_COUNT = sizeof(DEVICE_PROFILES) / sizeof(DEVICE_PROFILES[0]);
+
+// single return statements, so that the table is checked at compile time from C++11 on
+constexpr const BootAttrs *findDeviceProfile(int device_id, size_t from = 0)
+{
+    return from == DEVICE_PROFILE_COUNT ? nullptr
+           : DEVICE_PROFILES[from].device_id == device_id ? &DEVICE_PROFILES[from]
+                                                         : findDeviceProfile(device_id, from + 1);
+}
+
+constexpr bool validDeviceProfile(const BootAttrs &profile)
+{
+    // pages are made of write blocks (erase_size is in words, 2 bytes each), and a packet holds at least one
+    return profile.write_size > 0 && (profile.erase_size * 2) % profile.write_size == 0 &&
+           profile.max_packet_length - 11 >= profile.write_size &&
+           (profile.memory_end - profile.memory_start) % profile.erase_size == 0 &&
+           findDeviceProfile(profile.device_id) == &profile;
+}
+
+constexpr bool validDeviceProfiles(size_t from = 0)
+{
+    return from == DEVICE_PROFILE_COUNT || (validDeviceProfile(DEVICE_PROFILES[from]) && validDeviceProfiles(from + 1));
+}
+static_assert(validDeviceProfiles(), "a device profile has an impossible geometry, or its device id is repeated");
+
+/// @brief BootAttrs of the part `device_id`, throws std::invalid_argument if it is not in DEVICE_PROFILES.
+inline BootAttrs deviceProfile(int device_id)
+{
+    const BootAttrs *profile = findDeviceProfile(device_id);
+    if (profile == nullptr)
+    {
+        throw std::invalid_argument("no profile for device id " + std::to_string(device_id));
+    }
+    return *profile;
+}
+
+/// @brief true if the handshake gave the BootAttrs of the profile, so that what was prepared with it is valid.
+inline bool matchesDeviceProfile(const BootAttrs &bootattrs)
+{
+    const BootAttrs *profile = findDeviceProfile(bootattrs.device_id);
+    return profile != nullptr && profile->max_packet_length <= bootattrs.max_packet_length &&
+           profile->erase_size == bootattrs.erase_size && profile->write_size == bootattrs.write_size &&
+           profile->memory_start == bootattrs.memory_start && profile->memory_end == bootattrs.memory_end &&
+           profile->has_checksum == bootattrs.has_checksum;
+}
+
+#endif /* PROFILES_H */
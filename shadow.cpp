@@ -0,0 +1,103 @@
+#include "doctest.h"
+
+#include "shadow.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+ShadowImage::ShadowImage(const std::string &path, BootAttrs bootattrs, unsigned int serial)
+    : fd(-1), mapped_size(0), header(nullptr), memory(nullptr), memory_size(0), bootattrs(bootattrs)
+{
+    memory_size = (bootattrs.memory_end - bootattrs.memory_start) * 2;
+    mapped_size = sizeof(ShadowHeader) + memory_size;
+
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error("cannot open shadow image " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    bool fresh = fstat(fd, &st) != 0 || (size_t)st.st_size != mapped_size;
+    if (fresh && ftruncate(fd, mapped_size) != 0)
+    {
+        ::close(fd);
+        throw std::runtime_error("cannot resize shadow image " + path + ": " + strerror(errno));
+    }
+    void *mapping = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+        ::close(fd);
+        throw std::runtime_error("cannot map shadow image " + path + ": " + strerror(errno));
+    }
+    header = static_cast<ShadowHeader *>(mapping);
+    memory = static_cast<uint8_t *>(mapping) + sizeof(ShadowHeader);
+
+    if (fresh || memcmp(header->magic, SHADOW_MAGIC, sizeof(header->magic)) != 0 ||
+        header->device_id != (uint32_t)bootattrs.device_id || header->serial != serial ||
+        header->memory_start != (uint32_t)bootattrs.memory_start ||
+        header->memory_end != (uint32_t)bootattrs.memory_end ||
+        header->erase_size != (uint32_t)bootattrs.erase_size)
+    {
+        memset(header, 0, sizeof(ShadowHeader));
+        memcpy(header->magic, SHADOW_MAGIC, sizeof(header->magic));
+        header->device_id = bootattrs.device_id;
+        header->serial = serial;
+        header->memory_start = bootattrs.memory_start;
+        header->memory_end = bootattrs.memory_end;
+        header->erase_size = bootattrs.erase_size;
+        header->state = SHADOW_UNKNOWN;
+    }
+}
+
+ShadowImage::~ShadowImage()
+{
+    if (header != nullptr)
+    {
+        msync(header, mapped_size, MS_SYNC);
+        munmap(header, mapped_size);
+    }
+    if (fd >= 0)
+    {
+        ::close(fd);
+    }
+}
+
+ShadowState ShadowImage::getState() const
+{
+    return static_cast<ShadowState>(header->state);
+}
+
+void ShadowImage::setState(ShadowState state)
+{
+    if (state == SHADOW_VALID)
+    {
+        msync(header, mapped_size, MS_SYNC);
+    }
+    header->state = state;
+    msync(header, sizeof(ShadowHeader), MS_SYNC);
+}
+
+uint8_t *ShadowImage::at(unsigned int address)
+{
+    return memory + (address - bootattrs.memory_start) * 2;
+}
+
+ShadowStore::ShadowStore(const std::string &directory) : directory(directory)
+{
+    if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        throw std::runtime_error("cannot create shadow directory " + directory + ": " + strerror(errno));
+    }
+}
+
+std::string ShadowStore::path(unsigned int device_id, unsigned int serial) const
+{
+    std::stringstream ss;
+    ss << directory << "/" << std::hex << std::setw(4) << std::setfill('0') << device_id
+       << "-" << std::dec << serial << ".shadow";
+    return ss.str();
+}
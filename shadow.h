@@ -0,0 +1,70 @@
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include "hexfile.h"
+
+#include <string>
+
+#define SHADOW_MAGIC "MCBSHDW1"
+
+enum ShadowState
+{
+    SHADOW_UNKNOWN = 0, // never flashed through this store, or geometry changed
+    SHADOW_VALID = 1,   // program memory is exactly `memory`
+    SHADOW_DIRTY = 2    // an update was interrupted, some pages may differ
+};
+
+struct ShadowHeader
+{
+    char magic[8];
+    uint32_t device_id;
+    uint32_t serial;
+    uint32_t memory_start;
+    uint32_t memory_end;
+    uint32_t erase_size;
+    uint32_t state;
+    uint8_t reserved[32];
+};
+
+/// @brief Copy of the program memory of one device, as it was last flashed from this host.
+// The file is mapped in memory : `memory` holds the program memory bytes as in a HEX file
+// (2 bytes per word address, erased instructions read FF FF FF 00), from memory_start to memory_end.
+class ShadowImage
+{
+private:
+    int fd;
+    size_t mapped_size;
+    ShadowHeader *header;
+
+public:
+    uint8_t *memory;
+    size_t memory_size;
+    BootAttrs bootattrs;
+
+    /// @brief opens (or creates) the shadow stored in `path`. An existing file made for another
+    /// device or memory layout is reset to SHADOW_UNKNOWN.
+    ShadowImage(const std::string &path, BootAttrs bootattrs, unsigned int serial);
+    ~ShadowImage();
+
+    ShadowImage(const ShadowImage &) = delete;
+    ShadowImage &operator=(const ShadowImage &) = delete;
+
+    ShadowState getState() const;
+    /// @brief updates the state, and flushes `memory` to disk first when the shadow becomes valid.
+    void setState(ShadowState state);
+
+    /// @brief pointer to the bytes of word address `address`.
+    uint8_t *at(unsigned int address);
+};
+
+/// @brief Directory of shadow images, one file per device id and host assigned serial number.
+class ShadowStore
+{
+public:
+    std::string directory;
+
+    explicit ShadowStore(const std::string &directory);
+    std::string path(unsigned int device_id, unsigned int serial) const;
+};
+
+#endif /* SHADOW_H */
@@ -0,0 +1,243 @@
+#include "doctest.h"
+
+#include "simulator.h"
+#include "bootloader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+SimulatedBootloader::SimulatedBootloader(BootAttrs bootattrs)
+    : bootattrs(bootattrs), checksum_supported(bootattrs.has_checksum), erased_pages(0), written_bytes(0), failing_verifies(0)
+{
+    memory.resize((bootattrs.memory_end - bootattrs.memory_start) * 2);
+    fillErased(memory.data(), memory.size());
+}
+
+uint8_t *SimulatedBootloader::at(unsigned int address)
+{
+    return memory.data() + (address - bootattrs.memory_start) * 2;
+}
+
+bool SimulatedBootloader::inRange(unsigned int address, unsigned int length) const
+{
+    return address >= (unsigned int)bootattrs.memory_start &&
+           address + length / 2 <= (unsigned int)bootattrs.memory_end;
+}
+
+void SimulatedBootloader::write(const uint8_t *data, size_t size)
+{
+    input.insert(input.end(), data, data + size);
+
+    while (input.size() >= Command::getSize())
+    {
+        std::array<uint8_t, 11> header;
+        std::copy(input.begin(), input.begin() + header.size(), header.begin());
+        Packet command(0);
+        command.fromBytes(header);
+
+        size_t needed = Command::getSize();
+        if (command.getCommand() == CommandCode::WRITE_FLASH)
+            needed += command.getDataLength();
+        if (input.size() < needed)
+            break;
+
+        command_log.push_back(command.getCommand());
+        handle(command, input.data() + Command::getSize());
+        input.erase(input.begin(), input.begin() + needed);
+    }
+}
+
+size_t SimulatedBootloader::read(uint8_t *data, size_t size, int timeout_ms)
+{
+    size_t n = std::min(size, output.size());
+    std::copy(output.begin(), output.begin() + n, data);
+    output.erase(output.begin(), output.begin() + n);
+    return n;
+}
+
+void SimulatedBootloader::respond(const Packet &command, const uint8_t *payload, size_t size)
+{
+    std::array<uint8_t, 11> header = command.toBytes();
+    output.insert(output.end(), header.begin(), header.end());
+    output.insert(output.end(), payload, payload + size);
+}
+
+void SimulatedBootloader::respond(const Packet &command, ResponseCode status, const uint8_t *payload, size_t size)
+{
+    uint8_t code = status;
+    respond(command, &code, 1);
+    output.insert(output.end(), payload, payload + size);
+}
+
+void SimulatedBootloader::handle(const Packet &command, const uint8_t *data)
+{
+    unsigned int address = command.getAddress();
+    unsigned int length = command.getDataLength();
+
+    switch (command.getCommand())
+    {
+    case CommandCode::READ_VERSION:
+    {
+        Version version(CommandCode::READ_VERSION, 0, 0, 0,
+                        bootattrs.version, bootattrs.max_packet_length, bootattrs.device_id,
+                        bootattrs.erase_size, bootattrs.write_size);
+        std::array<uint8_t, 37> bytes = version.toBytes();
+        output.insert(output.end(), bytes.begin(), bytes.end());
+        break;
+    }
+    case CommandCode::GET_MEMORY_ADDRESS_RANGE:
+    {
+        uint32_t range[2] = {(uint32_t)bootattrs.memory_start, (uint32_t)bootattrs.memory_end - 2};
+        respond(command, ResponseCode::SUCCESS, reinterpret_cast<const uint8_t *>(range), sizeof(range));
+        break;
+    }
+    case CommandCode::ERASE_FLASH:
+    {
+        unsigned int words = length * bootattrs.erase_size;
+        if (command.getUnlockSequence() != BOOTLOADER_UNLOCK_SEQUENCE || address % bootattrs.erase_size != 0 ||
+            !inRange(address, words * 2))
+        {
+            respond(command, ResponseCode::BAD_ADDRESS);
+            break;
+        }
+        fillErased(at(address), words * 2);
+        erased_pages += length;
+        respond(command, ResponseCode::SUCCESS);
+        break;
+    }
+    case CommandCode::WRITE_FLASH:
+    {
+        if (length == 0 || length % bootattrs.write_size != 0 ||
+            length > bootattrs.max_packet_length - Command::getSize())
+        {
+            respond(command, ResponseCode::BAD_LENGTH);
+            break;
+        }
+        if (command.getUnlockSequence() != BOOTLOADER_UNLOCK_SEQUENCE ||
+            address % (bootattrs.write_size / 2) != 0 || !inRange(address, length))
+        {
+            respond(command, ResponseCode::BAD_ADDRESS);
+            break;
+        }
+        uint8_t *target = at(address);
+        for (unsigned int i = 0; i < length; i++)
+        {
+            // flash programming can only clear bits, and the phantom byte does not exist
+            target[i] = (i % 4 == 3) ? 0 : (target[i] & data[i]);
+        }
+        written_bytes += length;
+        respond(command, ResponseCode::SUCCESS);
+        break;
+    }
+    case CommandCode::READ_FLASH:
+    {
+        if (length > bootattrs.max_packet_length - Response::getSize())
+        {
+            respond(command, ResponseCode::BAD_LENGTH);
+            break;
+        }
+        if (!inRange(address, length))
+        {
+            respond(command, ResponseCode::BAD_ADDRESS);
+            break;
+        }
+        respond(command, ResponseCode::SUCCESS, at(address), length);
+        break;
+    }
+    case CommandCode::CALC_CHECKSUM:
+    {
+        if (!checksum_supported)
+        {
+            respond(command, ResponseCode::UNSUPPORTED_COMMAND);
+            break;
+        }
+        if (!inRange(address, length))
+        {
+            respond(command, ResponseCode::BAD_ADDRESS);
+            break;
+        }
+        uint16_t checksum = localChecksum(at(address), length) & 0xFFFF;
+        respond(command, ResponseCode::SUCCESS, reinterpret_cast<const uint8_t *>(&checksum), sizeof(checksum));
+        break;
+    }
+    case CommandCode::SELF_VERIFY:
+        if (failing_verifies > 0)
+        {
+            failing_verifies--;
+            respond(command, ResponseCode::VERIFY_FAIL);
+            break;
+        }
+        respond(command, ResponseCode::SUCCESS);
+        break;
+    case CommandCode::RESET_DEVICE:
+        respond(command, ResponseCode::SUCCESS);
+        break;
+    default:
+        respond(command, ResponseCode::UNSUPPORTED_COMMAND);
+        break;
+    }
+}
+
+PtySimulator::PtySimulator(BootAttrs bootattrs) : master(-1), stopping(false), device(bootattrs), silent(false)
+{
+    master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0)
+    {
+        if (master >= 0)
+            ::close(master);
+        throw std::runtime_error(std::string("cannot create pseudo terminal: ") + strerror(errno));
+    }
+    slave_path = ptsname(master);
+    thread = std::thread(&PtySimulator::serve, this);
+}
+
+PtySimulator::~PtySimulator()
+{
+    stop();
+    ::close(master);
+}
+
+void PtySimulator::stop()
+{
+    stopping = true;
+    if (thread.joinable())
+        thread.join();
+}
+
+void PtySimulator::serve()
+{
+    std::vector<uint8_t> buffer(4096);
+    while (!stopping)
+    {
+        struct pollfd pfd = {master, POLLIN, 0};
+        if (::poll(&pfd, 1, 10) <= 0 || !(pfd.revents & POLLIN))
+        {
+            // POLLHUP until the slave side is opened : do not spin
+            if (pfd.revents & POLLHUP)
+                usleep(1000);
+            continue;
+        }
+        ssize_t n = ::read(master, buffer.data(), buffer.size());
+        if (n <= 0 || silent)
+            continue;
+        device.write(buffer.data(), n);
+
+        size_t available = device.read(buffer.data(), buffer.size(), 0);
+        while (available > 0)
+        {
+            size_t offset = 0;
+            while (offset < available)
+            {
+                ssize_t written = ::write(master, buffer.data() + offset, available - offset);
+                if (written <= 0)
+                    break;
+                offset += written;
+            }
+            available = device.read(buffer.data(), buffer.size(), 0);
+        }
+    }
+}
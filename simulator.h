@@ -0,0 +1,70 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include "hexfile.h"
+#include "connection.h"
+
+#include <atomic>
+#include <deque>
+#include <thread>
+
+/// @brief In-memory MCC 16-bit bootloader, answering commands the way the firmware does.
+// Program memory is kept as it appears in a HEX file : 4 bytes per instruction, 2 bytes per word address.
+// Like real flash, writing can only clear bits, so a page must be erased before it is rewritten.
+class SimulatedBootloader : public Connection
+{
+private:
+    std::vector<uint8_t> input;
+    std::deque<uint8_t> output;
+
+    void handle(const Packet &command, const uint8_t *data);
+    void respond(const Packet &command, const uint8_t *payload = nullptr, size_t size = 0);
+    void respond(const Packet &command, ResponseCode status, const uint8_t *payload = nullptr, size_t size = 0);
+    bool inRange(unsigned int address, unsigned int length) const;
+
+public:
+    BootAttrs bootattrs;
+    std::vector<uint8_t> memory; // bytes from memory_start * 2 to memory_end * 2
+    bool checksum_supported;
+    unsigned int erased_pages;
+    unsigned int written_bytes;
+    unsigned int failing_verifies; // number of coming SELF_VERIFY answered VERIFY_FAIL, like a broken application
+    std::vector<unsigned int> command_log; // CommandCode of every command received
+
+    explicit SimulatedBootloader(BootAttrs bootattrs);
+
+    void write(const uint8_t *data, size_t size) override;
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override;
+
+    /// @brief pointer to the bytes of word address `address`, as in the HEX file.
+    uint8_t *at(unsigned int address);
+};
+
+/// @brief A simulated bootloader behind a pseudo terminal, served by its own thread.
+// `path()` can be opened as a serial port (SerialConnection), like a /dev/ttyUSB* adapter.
+class PtySimulator
+{
+private:
+    int master;
+    std::string slave_path;
+    std::atomic<bool> stopping;
+    std::thread thread;
+
+    void serve();
+
+public:
+    SimulatedBootloader device;
+    std::atomic<bool> silent; // swallows the commands without answering, like a board stuck in its application
+
+    explicit PtySimulator(BootAttrs bootattrs);
+    ~PtySimulator();
+
+    PtySimulator(const PtySimulator &) = delete;
+    PtySimulator &operator=(const PtySimulator &) = delete;
+
+    const std::string &path() const { return slave_path; }
+    /// @brief stops serving, `device` can be inspected afterwards.
+    void stop();
+};
+
+#endif /* SIMULATOR_H */
@@ -1,6 +1,22 @@
 #include "doctest.h"
 #include <vector>
+#include <fstream>
+#include <fcntl.h> // open
+#include <sys/epoll.h> // EPOLLIN
+#include <unistd.h> // unlink
 #include "hexfile.h"
+#include "flasher.h"
+#include "bench.h"
+#include "costmodel.h"
+#include "plan.h"
+#include "profiles.h"
+#include "prepare.h"
+#include "chunker.h"
+#include "packed.h"
+#include "simulator.h"
+#include "fleet.h"
+#include "uring.h"
+#include "coflash.h"
 #include <algorithm> //std::remove
 
 #define FLASH_HEX_FILE "/home/yoctouser/mcbootflash-cpp/mcbootflash/tests/testcases/flash/test.hex"
@@ -909,3 +925,1322 @@ TEST_CASE("Segment.chunked function for last segment")
         CHECK(lastSegmentChunks[i].data == lastSegmentChunksFromPython[i].data);
     }
 }
+
+std::string ihexLine(const std::vector<uint8_t> &record)
+{
+    std::string line = ":" + bytesToHexString(record);
+    line.erase(std::remove(line.begin(), line.end(), ' '), line.end());
+    return line;
+}
+
+/// @brief writes `segments` (byte addresses, as in the HEX file) to a temporary Intel HEX file.
+// Used by the tests which need an image but not a real firmware.
+std::string writeTestHexFile(const std::string &name, const std::vector<Segment> &segments)
+{
+    HexFile hex;
+    std::string path = "/tmp/mcbootflash_" + name + ".hex";
+    std::ofstream file(path);
+    unsigned int upper = 0;
+    for (const Segment &segment : segments)
+    {
+        for (size_t offset = 0; offset < segment.data.size(); offset += 16)
+        {
+            unsigned int address = segment.minimum_address + offset;
+            if ((address >> 16) != upper)
+            {
+                upper = address >> 16;
+                std::vector<uint8_t> record{2, 0, 0, IHEX_EXTENDED_LINEAR_ADDRESS, (uint8_t)(upper >> 8), (uint8_t)upper};
+                record.push_back(hex.crc_ihex(record));
+                file << ihexLine(record) << std::endl;
+            }
+            size_t size = std::min((size_t)16, segment.data.size() - offset);
+            std::vector<uint8_t> record{(uint8_t)size, (uint8_t)(address >> 8), (uint8_t)address, IHEX_DATA};
+            record.insert(record.end(), segment.data.begin() + offset, segment.data.begin() + offset + size);
+            record.push_back(hex.crc_ihex(record));
+            file << ihexLine(record) << std::endl;
+        }
+    }
+    file << ":00000001FF" << std::endl;
+    return path;
+}
+
+/// @brief a PIC24 looking image : 4 bytes per instruction, phantom byte always 0.
+std::vector<uint8_t> testImageData(size_t size, unsigned int seed)
+{
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        data[i] = (i % 4 == 3) ? 0 : (uint8_t)(i * 7 + seed);
+    }
+    return data;
+}
+
+std::vector<Segment> testImageSegments()
+{
+    return std::vector<Segment>{
+        Segment(0x3000, 0x3000 + 3 * 4096 + 200, testImageData(3 * 4096 + 200, 1), 1),
+        Segment(0x10000, 0x10000 + 1000, testImageData(1000, 2), 1),
+    };
+}
+
+TEST_CASE("Bootloader getBootAttrs from the simulated bootloader")
+{
+    BootAttrs expected = defaultBootAttrsForTest();
+    SimulatedBootloader device(expected);
+    Bootloader bootloader(device);
+
+    BootAttrs bootattrs = bootloader.getBootAttrs();
+    CHECK(bootattrs.version == expected.version);
+    CHECK(bootattrs.max_packet_length == expected.max_packet_length);
+    CHECK(bootattrs.device_id == expected.device_id);
+    CHECK(bootattrs.erase_size == expected.erase_size);
+    CHECK(bootattrs.write_size == expected.write_size);
+    CHECK(bootattrs.memory_start == expected.memory_start);
+    CHECK(bootattrs.memory_end == expected.memory_end);
+    CHECK(bootattrs.has_checksum);
+
+    device.checksum_supported = false;
+    CHECK_FALSE(bootloader.getBootAttrs().has_checksum);
+}
+
+TEST_CASE("FlashPages splits chunks along erase pages")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("pages", testImageSegments()), bootattrs);
+    FlashPages image(chunks, bootattrs);
+
+    CHECK(image.pageBytes() == 4096);
+    CHECK(image.max_checksum_pages == 15);
+    CHECK(image.pages.size() == 5);
+    CHECK(image.pages[0].address == 0x1800);
+    CHECK(image.pages[4].address == 0x8000);
+
+    unsigned int bytes = 0;
+    for (const Page &page : image.pages)
+    {
+        for (const Segment &chunk : page.chunks)
+        {
+            CHECK(chunk.address() >= page.address);
+            CHECK(chunk.address() + chunk.data.size() / 2 <= page.address + image.page_words);
+            bytes += chunk.data.size();
+        }
+    }
+    CHECK(bytes == hex.processed_total_bytes);
+
+    std::vector<std::pair<size_t, size_t>> ranges = image.checksumRanges();
+    CHECK(ranges.size() == 2);
+    CHECK(ranges[0] == std::make_pair((size_t)0, (size_t)4));
+    CHECK(ranges[1] == std::make_pair((size_t)4, (size_t)5));
+}
+
+TEST_CASE("Flasher verifyAndRepair rewrites only the corrupted pages")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    Bootloader bootloader(device);
+    Flasher flasher(bootloader, bootattrs);
+
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("repair", testImageSegments()), bootattrs);
+    FlashPages image(chunks, bootattrs);
+
+    flasher.flash(chunks);
+    CHECK(flasher.findMismatchedPages(image).empty());
+    std::vector<uint8_t> flashed = device.memory;
+
+    device.at(image.pages[2].address)[100] ^= 0x10;
+    device.at(image.pages[4].address)[8] ^= 0x01;
+
+    unsigned int erased = device.erased_pages;
+    std::vector<size_t> repaired = flasher.verifyAndRepair(image);
+    CHECK(repaired == std::vector<size_t>{2, 4});
+    CHECK(device.erased_pages - erased == 2);
+    CHECK(device.memory == flashed);
+
+    unsigned int round_trips = bootloader.round_trips;
+    CHECK(flasher.findMismatchedPages(image).empty());
+    CHECK(bootloader.round_trips - round_trips == 2);
+}
+
+TEST_CASE("Flasher flashDelta rewrites only the pages that changed")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    Bootloader bootloader(device);
+    Flasher flasher(bootloader, bootattrs);
+
+    HexFile previous;
+    std::vector<Segment> previous_chunks = previous.chunked(writeTestHexFile("delta_previous", testImageSegments()), bootattrs);
+    flasher.flash(previous_chunks);
+
+    // new firmware : one instruction changed in the second page, the second segment is gone
+    std::vector<Segment> segments = testImageSegments();
+    segments[0].data[4096 + 40] ^= 0xFF;
+    segments.pop_back();
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("delta", segments), bootattrs);
+    FlashPages image(chunks, bootattrs);
+
+    unsigned int erased = device.erased_pages;
+    unsigned int written = device.written_bytes;
+    CHECK(flasher.flashDelta(image) == std::vector<size_t>{1});
+    CHECK(device.erased_pages - erased == 2);
+    CHECK(device.written_bytes - written == 4096);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+    CHECK(device.memory == reference.memory);
+
+    CHECK(flasher.flashDelta(image).empty());
+}
+
+TEST_CASE("Flasher flashShadowed sends the pages that differ from the shadow")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    Bootloader bootloader(device);
+    Flasher flasher(bootloader, bootattrs);
+    ShadowStore store("/tmp/mcbootflash_shadow");
+    std::string path = store.path(bootattrs.device_id, 1);
+    unlink(path.c_str());
+
+    HexFile previous;
+    FlashPages previous_image(previous.chunked(writeTestHexFile("shadow_previous", testImageSegments()), bootattrs), bootattrs);
+    {
+        ShadowImage shadow(path, bootattrs, 1);
+        CHECK(shadow.getState() == SHADOW_UNKNOWN);
+        flasher.flashShadowed(previous_image, shadow);
+        CHECK(shadow.getState() == SHADOW_VALID);
+    }
+
+    std::vector<Segment> segments = testImageSegments();
+    segments[0].data[2 * 4096 + 12] ^= 0xFF;
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("shadow", segments), bootattrs);
+    FlashPages image(chunks, bootattrs);
+
+    ShadowImage shadow(path, bootattrs, 1);
+    CHECK(shadow.getState() == SHADOW_VALID);
+    unsigned int round_trips = bootloader.round_trips;
+    std::vector<unsigned int> sent = flasher.flashShadowed(image, shadow);
+    CHECK(sent == std::vector<unsigned int>{image.pages[2].address});
+    // erase, writes of one page, 6 checksums for 82 pages, self verify
+    CHECK(bootloader.round_trips - round_trips == 1 + image.pages[2].chunks.size() + 6 + 1);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+    CHECK(device.memory == reference.memory);
+    CHECK(memcmp(shadow.memory, reference.memory.data(), shadow.memory_size) == 0);
+
+    // flashed behind the back of the shadow : detected by the final checksum, and repaired
+    device.at(image.pages[0].address)[0] ^= 0x01;
+    CHECK(flasher.flashShadowed(image, shadow) == std::vector<unsigned int>{image.pages[0].address});
+    CHECK(device.memory == reference.memory);
+}
+
+void checkFleet(FleetBackend backend)
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    HexFile hex;
+    std::shared_ptr<const std::vector<Segment>> chunks = std::make_shared<const std::vector<Segment>>(
+        hex.chunked(writeTestHexFile("fleet", testImageSegments()), bootattrs));
+
+    BootAttrs other = bootattrs;
+    other.device_id = 42;
+    PtySimulator first(bootattrs);
+    PtySimulator second(bootattrs);
+    PtySimulator wrong(other);
+    PtySimulator mute(bootattrs);
+    PtySimulator third(bootattrs);
+    mute.silent = true;
+
+    FleetFlasher fleet(chunks, bootattrs);
+    fleet.backend = backend;
+    fleet.timeout_ms = 200;
+    fleet.add(first.path(), 115200);
+    fleet.add(second.path(), 115200);
+    fleet.add(wrong.path(), 115200);
+    fleet.add(mute.path(), 115200);
+    fleet.add(third.path(), 115200);
+    CHECK(fleet.run() == 2);
+    CHECK(fleet.ports[2].session->error == "device 42 does not match the image");
+    CHECK(fleet.ports[3].session->error == "timeout while waiting for the bootloader");
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(*chunks);
+
+    for (PtySimulator *simulator : {&first, &second, &third})
+    {
+        simulator->stop();
+        CHECK(simulator->device.memory == reference.memory);
+        // the session starts with the handshake, then sends the same commands as Flasher::flash
+        std::vector<unsigned int> log = simulator->device.command_log;
+        CHECK(log.size() == reference.command_log.size() + 2);
+        CHECK(std::vector<unsigned int>(log.begin() + 2, log.end()) == reference.command_log);
+    }
+}
+
+TEST_CASE("FleetFlasher flashes several pseudo terminals from one thread")
+{
+    checkFleet(FLEET_EPOLL);
+}
+
+TEST_CASE("FleetFlasher stops when epoll cannot watch a port")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    PtySimulator simulator(bootattrs);
+    FleetFlasher fleet(std::make_shared<const std::vector<Segment>>(), bootattrs);
+    fleet.add(simulator.path(), 115200);
+
+    // a regular file in place of the terminal : epoll refuses it
+    int file = ::open("/tmp/mcbootflash_not_a_tty", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    REQUIRE(file >= 0);
+    REQUIRE(dup2(file, fleet.ports[0].connection->getFd()) >= 0);
+    ::close(file);
+    unlink("/tmp/mcbootflash_not_a_tty");
+    CHECK_THROWS_AS(fleet.run(), std::runtime_error);
+}
+
+TEST_CASE("FleetFlasher io_uring backend")
+{
+    if (!IoUring::available())
+    {
+        MESSAGE("io_uring not available, skipped");
+        return;
+    }
+    checkFleet(FLEET_IO_URING);
+}
+
+#if defined(__cpp_impl_coroutine)
+template <typename T>
+T runTask(EpollReactor &reactor, Task<T> task)
+{
+    task.start();
+    while (!task.done() && reactor.runOnce(1000))
+    {
+    }
+    REQUIRE(task.done());
+    return task.get();
+}
+
+TEST_CASE("CoBootloader flashes from an event loop without heap allocations once warm")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("coroutine", testImageSegments()), bootattrs);
+
+    PtySimulator simulator(bootattrs);
+    SerialConnection port(simulator.path(), 115200);
+    EpollReactor reactor;
+    CoBootloader bootloader(reactor, port.getFd());
+
+    BootAttrs found = runTask(reactor, bootloader.getBootAttrs());
+    CHECK(found.device_id == bootattrs.device_id);
+    CHECK(found.memory_end == bootattrs.memory_end);
+    CHECK(found.has_checksum);
+
+    runTask(reactor, bootloader.flash(chunks, found));
+    size_t allocations = FramePool::heapAllocations();
+    runTask(reactor, bootloader.flash(chunks, found));
+    CHECK(FramePool::heapAllocations() == allocations);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+    simulator.stop();
+    CHECK(simulator.device.memory == reference.memory);
+}
+
+TEST_CASE("CoBootloader times out on a silent device")
+{
+    PtySimulator simulator(defaultBootAttrsForTest());
+    simulator.silent = true;
+    SerialConnection port(simulator.path(), 115200);
+    EpollReactor reactor;
+    CoBootloader bootloader(reactor, port.getFd());
+    bootloader.timeout_ms = 50;
+
+    CHECK_THROWS_AS(runTask(reactor, bootloader.selfVerify()), BootloaderError);
+}
+
+TEST_CASE("EpollReactor reports an fd epoll cannot watch")
+{
+    EpollReactor reactor;
+    int file = ::open("/tmp/mcbootflash_not_a_tty", O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    REQUIRE(file >= 0);
+    bool timed_out = false;
+    CHECK_THROWS_AS(reactor.watch(file, EPOLLIN, 50, std::noop_coroutine(), &timed_out), std::runtime_error);
+    CHECK_FALSE(reactor.runOnce(0)); // nothing left waiting
+    ::close(file);
+    unlink("/tmp/mcbootflash_not_a_tty");
+}
+#endif
+
+TEST_CASE("Flasher dump reads back the flashed image")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    Bootloader bootloader(device);
+    Flasher flasher(bootloader, bootattrs);
+
+    HexFile hex;
+    std::string path = writeTestHexFile("dump_source", testImageSegments());
+    std::vector<Segment> chunks = hex.chunked(path, bootattrs);
+    flasher.flash(chunks);
+
+    bootloader.round_trips = 0;
+    HexFile dumped = flasher.dump();
+    unsigned int stop_and_wait = bootloader.round_trips;
+    std::vector<Segment> segments = testImageSegments();
+    REQUIRE(dumped.segments.size() == segments.size());
+    for (size_t i = 0; i < segments.size(); i++)
+    {
+        CHECK(dumped.segments[i].minimum_address == segments[i].minimum_address);
+        CHECK(dumped.segments[i].data == segments[i].data);
+    }
+
+    // the Intel HEX output is read back to the same chunks
+    std::string dump_path = "/tmp/mcbootflash_dump.hex";
+    std::ofstream(dump_path) << dumped.as_ihex();
+    HexFile reread;
+    std::vector<Segment> reread_chunks = reread.chunked(dump_path, bootattrs);
+    REQUIRE(reread_chunks.size() == chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        CHECK(reread_chunks[i].minimum_address == chunks[i].minimum_address);
+        CHECK(reread_chunks[i].data == chunks[i].data);
+    }
+
+    // pipelined, the same bytes with as many packets
+    bootloader.round_trips = 0;
+    HexFile full = flasher.dump(4, false);
+    CHECK(bootloader.round_trips == stop_and_wait);
+    CHECK(full.as_binary() == device.memory);
+}
+
+TEST_CASE("HexFile as_ihex record layout")
+{
+    HexFile hex;
+    hex.add_binary(std::vector<uint8_t>{0x01, 0x02, 0x03, 0x04}, 0x1fffe);
+    CHECK(hex.as_ihex() == ":020000040001F9\n"
+                           ":02FFFE000102FE\n"
+                           ":020000040002F8\n"
+                           ":020000000304F7\n"
+                           ":00000001FF\n");
+    CHECK(hex.as_binary() == std::vector<uint8_t>{0x01, 0x02, 0x03, 0x04});
+}
+
+TEST_CASE("Flasher update rolls back to the snapshot when the new application fails")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    Bootloader bootloader(device);
+    Flasher flasher(bootloader, bootattrs);
+
+    HexFile previous;
+    flasher.flash(previous.chunked(writeTestHexFile("rollback_previous", testImageSegments()), bootattrs));
+    std::vector<uint8_t> before = device.memory;
+
+    // new firmware : one instruction changed in the second page, the second segment is gone
+    std::vector<Segment> segments = testImageSegments();
+    segments[0].data[4096 + 40] ^= 0xFF;
+    segments.pop_back();
+    HexFile hex;
+    FlashPages image(hex.chunked(writeTestHexFile("rollback", segments), bootattrs), bootattrs);
+
+    std::string snapshot = "/tmp/mcbootflash_rollback.snapshot.hex";
+    device.failing_verifies = 1;
+    unsigned int erased = device.erased_pages;
+    CHECK_THROWS_AS(flasher.update(image, snapshot, 4), BootloaderError);
+    CHECK(device.memory == before);
+    // update : the changed page and the page of the second segment, rollback : the same two pages
+    CHECK(device.erased_pages - erased == 4);
+
+    // a successful update keeps the previous application in the snapshot
+    CHECK(flasher.update(image, snapshot) == std::vector<size_t>{1});
+    CHECK(device.memory != before);
+    CHECK(flasher.rollback(snapshot).size() == 2);
+    CHECK(device.memory == before);
+
+    // the snapshot of a blank device, whatever the case of its hex digits
+    std::ofstream(snapshot) << ":00000001ff\r\n";
+    flasher.rollback(snapshot);
+    CHECK(device.memory == SimulatedBootloader(bootattrs).memory);
+    CHECK_THROWS_AS(flasher.rollback("/tmp/mcbootflash_no_such.snapshot.hex"), std::runtime_error);
+
+    // an erased instruction in the write block of a programmed one is written back erased, not as 0x000000
+    uint8_t *block = device.at(bootattrs.memory_end - bootattrs.erase_size);
+    REQUIRE(std::vector<uint8_t>(block, block + 8) == std::vector<uint8_t>{0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff, 0x00});
+    const uint8_t programmed[4] = {0x12, 0x34, 0x56, 0x00};
+    std::copy(programmed, programmed + 4, block);
+    before = device.memory;
+    flasher.snapshot(snapshot);
+    HexFile other;
+    flasher.flash(other.chunked(writeTestHexFile("rollback_block", testImageSegments()), bootattrs));
+    flasher.rollback(snapshot);
+    CHECK(std::vector<uint8_t>(block, block + 8) == std::vector<uint8_t>{0x12, 0x34, 0x56, 0x00, 0xff, 0xff, 0xff, 0x00});
+    CHECK(device.memory == before);
+}
+
+TEST_CASE("RttEstimator follows the TCP retransmission timeout")
+{
+    RttEstimator estimator;
+    CHECK(estimator.timeout(1000) == 1000);
+    estimator.sample(100);
+    CHECK(estimator.timeout(1000) == 300); // 100 + 4 * 50
+    estimator.sample(100);
+    CHECK(estimator.timeout(1000) == 250); // rttvar 37.5
+    estimator.timedOut();
+    CHECK(estimator.timeout(1000) == 500);
+    estimator.sample(1);
+    CHECK(estimator.backoff == 1);
+    for (int i = 0; i < 100; i++)
+        estimator.sample(1);
+    CHECK(estimator.timeout(1000) == BOOTLOADER_MIN_TIMEOUT_MS);
+}
+
+TEST_CASE("Bootloader detects a silent device faster once round trips are measured")
+{
+    PtySimulator simulator(defaultBootAttrsForTest());
+    SerialConnection port(simulator.path(), 115200);
+    Bootloader bootloader(port);
+    for (int i = 0; i < 8; i++)
+        bootloader.readVersion();
+    CHECK(bootloader.rtt[CommandCode::READ_VERSION].samples == 8);
+    CHECK(bootloader.rtt[CommandCode::ERASE_FLASH].samples == 0);
+
+    simulator.silent = true;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    CHECK_THROWS_AS(bootloader.readVersion(), BootloaderError);
+    CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(bootloader.timeout_ms / 2));
+    CHECK(bootloader.rtt[CommandCode::READ_VERSION].backoff == 2);
+}
+
+/// @brief passes the commands to a simulated device, but loses the ones chosen by the test, like a flaky link.
+class LossyConnection : public Connection
+{
+public:
+    SimulatedBootloader &device;
+    unsigned int commands;             // commands sent so far
+    std::vector<unsigned int> dropped; // indexes of the commands lost
+    unsigned int cut_after;            // every command from this one is lost, as if the adapter was unplugged
+
+    explicit LossyConnection(SimulatedBootloader &device) : device(device), commands(0), cut_after(~0u) {}
+
+    void write(const uint8_t *data, size_t size) override
+    {
+        unsigned int index = commands++;
+        if (index >= cut_after || std::find(dropped.begin(), dropped.end(), index) != dropped.end())
+            return;
+        device.write(data, size);
+    }
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override { return device.read(data, size, timeout_ms); }
+};
+
+TEST_CASE("Flasher flashResumable retries a lost chunk")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    LossyConnection link(device);
+    link.dropped = {2, 30};
+    Bootloader bootloader(link);
+    Flasher flasher(bootloader, bootattrs);
+
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("retry", testImageSegments()), bootattrs);
+    FlashPages image(chunks, bootattrs);
+    std::string path = "/tmp/mcbootflash_retry.journal";
+    unlink(path.c_str());
+    ProgressJournal journal(path);
+    CHECK(flasher.flashResumable(image, journal).size() == image.pages.size());
+    CHECK(access(path.c_str(), F_OK) != 0);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+    CHECK(device.memory == reference.memory);
+}
+
+TEST_CASE("Flasher flashResumable resumes an interrupted update from the journal")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("resume", testImageSegments()), bootattrs);
+    FlashPages image(chunks, bootattrs);
+    std::string path = "/tmp/mcbootflash_resume.journal";
+    unlink(path.c_str());
+
+    {
+        LossyConnection link(device);
+        link.cut_after = 40; // in the middle of the third page
+        Bootloader bootloader(link);
+        ProgressJournal journal(path);
+        CHECK_THROWS_AS(Flasher(bootloader, bootattrs).flashResumable(image, journal, 1), BootloaderError);
+    }
+
+    ProgressJournal journal(path);
+    CHECK(journal.image_id == ProgressJournal::imageId(image));
+    CHECK(journal.erased_all);
+    CHECK(journal.state(image.pages[0].address) == JOURNAL_VERIFIED);
+    CHECK(journal.state(image.pages[1].address) == JOURNAL_VERIFIED);
+
+    Bootloader bootloader(device);
+    unsigned int erased = device.erased_pages;
+    unsigned int written = device.written_bytes;
+    std::vector<size_t> pages = Flasher(bootloader, bootattrs).flashResumable(image, journal);
+    REQUIRE(!pages.empty());
+    CHECK(pages.front() == 2);
+    CHECK(pages.size() == image.pages.size() - 2);
+    CHECK(device.erased_pages == erased);
+    unsigned int rest = 0;
+    for (size_t i = 2; i < image.pages.size(); i++)
+        for (const Segment &chunk : image.pages[i].chunks)
+            rest += chunk.data.size();
+    CHECK(device.written_bytes - written == rest);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+    CHECK(device.memory == reference.memory);
+}
+
+TEST_CASE("ResponseFramer skips garbage in front of the response")
+{
+    Command request(CommandCode::CALC_CHECKSUM, 8, 0, 0x1800);
+    std::array<uint8_t, 11> header = request.toBytes();
+    std::vector<uint8_t> stream = {0x08, 0x00, 0x55}; // a truncated header, then line noise
+    stream.insert(stream.end(), header.begin(), header.end());
+    stream.push_back(ResponseCode::SUCCESS);
+    stream.push_back(0x34);
+
+    ResponseFramer framer;
+    framer.feed(stream.data(), stream.size());
+    CHECK(framer.frame(request) == 0);
+    CHECK(framer.skipped == 3);
+    CHECK(framer.missing(request) == 1);
+
+    uint8_t last = 0x12;
+    framer.feed(&last, 1);
+    REQUIRE(framer.frame(request) == 14);
+    CHECK(framer.data()[12] == 0x34);
+    CHECK(framer.data()[13] == 0x12);
+
+    // a known status byte is required after the header
+    Command erase(CommandCode::ERASE_FLASH, 1, BOOTLOADER_UNLOCK_SEQUENCE, 0x1800);
+    header = erase.toBytes();
+    ResponseFramer strict;
+    strict.feed(header.data(), header.size());
+    uint8_t status = 0x42;
+    strict.feed(&status, 1);
+    CHECK(strict.frame(erase) == 0);
+    CHECK(strict.skipped == 12);
+}
+
+/// @brief simulated device whose responses are preceded by a few stray bytes, like a noisy UART.
+class NoisyConnection : public Connection
+{
+public:
+    SimulatedBootloader &device;
+    std::vector<uint8_t> noise;
+    std::vector<uint8_t> output;
+
+    NoisyConnection(SimulatedBootloader &device, std::vector<uint8_t> noise) : device(device), noise(noise) {}
+
+    void write(const uint8_t *data, size_t size) override
+    {
+        device.write(data, size);
+        output.insert(output.end(), noise.begin(), noise.end());
+        uint8_t buffer[4096];
+        size_t n = device.read(buffer, sizeof(buffer), 0);
+        output.insert(output.end(), buffer, buffer + n);
+    }
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override
+    {
+        size_t n = std::min(size, output.size());
+        std::copy(output.begin(), output.begin() + n, data);
+        output.erase(output.begin(), output.begin() + n);
+        return n;
+    }
+};
+
+TEST_CASE("Bootloader resynchronizes on a noisy line without waiting for a timeout")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    NoisyConnection line(device, {CommandCode::CALC_CHECKSUM, 0x00, 0xFF});
+    Bootloader bootloader(line);
+
+    BootAttrs found = bootloader.getBootAttrs();
+    CHECK(found.device_id == bootattrs.device_id);
+    CHECK(found.memory_end == bootattrs.memory_end);
+    CHECK(bootloader.calcChecksum(bootattrs.memory_start, 64) == (erasedChecksum(64) & 0xFFFF));
+
+    std::vector<uint8_t> data(1024);
+    bootloader.readFlash(bootattrs.memory_start, data.size(), data.data(), 240, 4);
+    CHECK(data == std::vector<uint8_t>(device.memory.begin(), device.memory.begin() + data.size()));
+    // 3 stray bytes before each of the 3 handshake responses, the checksum and the 5 READ_FLASH responses
+    CHECK(bootloader.skippedBytes() == 3 * 9);
+}
+
+TEST_CASE("LinkBenchmark writes within the scratch page when it is smaller than a packet")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    bootattrs.erase_size = 32; // 64 bytes, a packet holds 240
+    SimulatedBootloader device(bootattrs);
+    Bootloader bootloader(device);
+    std::vector<uint8_t> blank = device.memory;
+
+    LinkBenchmark bench(bootloader, bootattrs);
+    bench.packets = 8;
+    unsigned int scratch = bootattrs.memory_end - 4 * bootattrs.erase_size;
+    double erase_ms_per_page = 0;
+    CHECK(bench.writeBandwidth(scratch, erase_ms_per_page) > 0);
+    // each packet fills the page : one erase before each of them, one after, and nothing written outside
+    CHECK(std::count(device.command_log.begin(), device.command_log.end(), (unsigned int)CommandCode::ERASE_FLASH) == 9);
+    CHECK(device.memory == blank);
+}
+
+TEST_CASE("LinkBenchmark measures the link and predicts the flash time")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    PtySimulator simulator(bootattrs);
+    SerialConnection port(simulator.path(), 115200);
+    Bootloader bootloader(port);
+
+    LinkBenchmark bench(bootloader, bootattrs);
+    bench.pings = 20;
+    unsigned int scratch = bootattrs.memory_end - bootattrs.erase_size;
+    LinkReport report = bench.run(scratch);
+    CHECK(report.ping.samples == 20);
+    CHECK(report.ping.min_ms <= report.ping.median_ms);
+    CHECK(report.ping.median_ms <= report.ping.p99_ms);
+    CHECK(report.checksum.samples == 20);
+    CHECK(report.read_bytes_per_s > 0);
+    CHECK(report.write_bytes_per_s > 0);
+    CHECK(report.packet_bytes == 240);
+    CHECK_THROWS_AS(bench.writeBandwidth(scratch + 1, report.erase_ms_per_page), std::invalid_argument);
+
+    // the scratch page is left erased
+    simulator.stop();
+    std::vector<uint8_t> erased(bootattrs.erase_size * 2);
+    fillErased(erased.data(), erased.size());
+    CHECK(std::equal(erased.begin(), erased.end(), simulator.device.at(scratch)));
+
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("bench", testImageSegments()), bootattrs);
+    double all = report.predictFlashSeconds(chunks, bootattrs);
+    double half = report.predictFlashSeconds(std::vector<Segment>(chunks.begin(), chunks.begin() + chunks.size() / 2), bootattrs);
+    CHECK(all > half);
+    CHECK(half > 0);
+}
+
+/// @brief simulated device behind an adapter which is slow with large packets, as some USB-serial drivers are.
+class BufferingConnection : public Connection
+{
+public:
+    SimulatedBootloader &device;
+    size_t threshold;
+    std::vector<size_t> sizes; // of every packet sent
+
+    BufferingConnection(SimulatedBootloader &device, size_t threshold) : device(device), threshold(threshold) {}
+
+    void write(const uint8_t *data, size_t size) override
+    {
+        sizes.push_back(size);
+        usleep(size > threshold ? 4000 : 200);
+        device.write(data, size);
+    }
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override { return device.read(data, size, timeout_ms); }
+};
+
+TEST_CASE("Flasher flashAutotuned picks the fastest chunk size and caches it")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    std::vector<unsigned int> candidates = chunkSizeCandidates(bootattrs);
+    CHECK(candidates == std::vector<unsigned int>{240, 176, 120, 56});
+
+    SimulatedBootloader device(bootattrs);
+    BufferingConnection adapter(device, 150);
+    Bootloader bootloader(adapter);
+    Flasher flasher(bootloader, bootattrs);
+
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("autotune", testImageSegments()), bootattrs);
+    std::string path = "/tmp/mcbootflash_chunk_sizes";
+    unlink(path.c_str());
+    ChunkSizeCache cache(path);
+    std::string key = ChunkSizeCache::key("/dev/ttyUSB0", bootattrs.device_id);
+    CHECK(flasher.flashAutotuned(chunks, cache, key) == 120);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+    CHECK(device.memory == reference.memory);
+
+    // the next flash uses the cached size from the start
+    ChunkSizeCache reloaded(path);
+    CHECK(reloaded.get(key) == 120);
+    adapter.sizes.clear();
+    CHECK(flasher.flashAutotuned(chunks, reloaded, key) == 120);
+    CHECK(*std::max_element(adapter.sizes.begin(), adapter.sizes.end()) == Command::getSize() + 120);
+    CHECK(device.memory == reference.memory);
+}
+
+TEST_CASE("FlashTimeModel predicts the flashing time of each strategy")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    FlashTimeModel model(bootattrs, LinkTiming());
+
+    // one READ_VERSION : latency, 11 bytes out, the bootloader, 37 bytes back, latency
+    std::vector<TracedCommand> ping{{Command(CommandCode::READ_VERSION), 11, 37}};
+    CHECK(model.replaySeconds(ping) * 1000 == doctest::Approx(1 + 48 * 10 * 1000.0 / 115200 + 0.05 + 1));
+
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("costmodel", testImageSegments()), bootattrs);
+    std::vector<TracedCommand> trace = model.traceFlash(chunks);
+    CHECK(trace.front().command.getCommand() == CommandCode::ERASE_FLASH);
+    CHECK(trace.back().command.getCommand() == CommandCode::SELF_VERIFY);
+    CHECK(trace.size() == 2 + 2 * chunks.size());
+
+    // the line is busy sending data at least that long
+    size_t bytes = 0;
+    for (const TracedCommand &command : trace)
+        bytes += command.request_bytes + command.response_bytes;
+    double line_s = bytes * 10.0 / 115200;
+    double pages = (bootattrs.memory_end - bootattrs.memory_start) / bootattrs.erase_size;
+
+    HexFile installed_hex;
+    std::vector<Segment> installed = testImageSegments();
+    installed[1] = Segment(0x10000, 0x10000 + 1000, testImageData(1000, 3), 1);
+    std::vector<Segment> installed_chunks = installed_hex.chunked(writeTestHexFile("costmodel_installed", installed), bootattrs);
+
+    FlashTimePrediction prediction = model.predict(chunks, installed_chunks, 4);
+    CHECK(prediction.stop_and_wait_s > line_s + pages * 0.025);
+    CHECK(prediction.pipelined_s < prediction.stop_and_wait_s);
+    CHECK(prediction.pipelined_s > line_s);
+    CHECK(prediction.rewritten_pages == 1);
+    CHECK(prediction.delta_s < prediction.pipelined_s);
+
+    // the same commands on a faster line
+    LinkTiming fast;
+    fast.baudrate = 1000000;
+    FlashTimeModel fast_model(bootattrs, fast);
+    CHECK(fast_model.replaySeconds(trace) < prediction.stop_and_wait_s);
+    CHECK_THROWS_AS(model.replaySeconds(trace, 0), std::invalid_argument);
+}
+
+/// @brief clears the first data byte of the first WRITE_FLASH, like noise the bootloader cannot detect.
+class CorruptingConnection : public Connection
+{
+public:
+    SimulatedBootloader &device;
+    bool corrupted;
+
+    explicit CorruptingConnection(SimulatedBootloader &device) : device(device), corrupted(false) {}
+
+    void write(const uint8_t *data, size_t size) override
+    {
+        if (corrupted || size <= Command::getSize() || data[0] != CommandCode::WRITE_FLASH)
+            return device.write(data, size);
+        std::vector<uint8_t> damaged(data, data + size);
+        damaged[Command::getSize()] = 0;
+        corrupted = true;
+        device.write(damaged.data(), damaged.size());
+    }
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override { return device.read(data, size, timeout_ms); }
+};
+
+/// @brief Echoes the unlock sequence of the commands as zeros, as some bootloader builds do.
+class UnlockEchoConnection : public Connection
+{
+public:
+    SimulatedBootloader &device;
+    std::deque<uint8_t> pending;
+
+    explicit UnlockEchoConnection(SimulatedBootloader &device) : device(device) {}
+
+    void write(const uint8_t *data, size_t size) override
+    {
+        device.write(data, size);
+        // one command at a time : what the device has now is the whole response to it
+        uint8_t response[4096];
+        size_t n = device.read(response, sizeof(response), 0);
+        for (size_t i = 0; i < n; i++)
+            pending.push_back(i >= 3 && i < 7 ? 0 : response[i]);
+    }
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override
+    {
+        size_t n = std::min(size, pending.size());
+        std::copy(pending.begin(), pending.begin() + n, data);
+        pending.erase(pending.begin(), pending.begin() + n);
+        return n;
+    }
+};
+
+TEST_CASE("Flasher flashPlan sends a precompiled plan")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("plan", testImageSegments()), bootattrs);
+    std::string path = "/tmp/mcbootflash_test.mcbp";
+    FlashPlan::compile(chunks, bootattrs, path);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+
+    {
+        FlashPlan plan(path);
+        CHECK(plan.header->steps == 2 + 2 * chunks.size());
+        CHECK(plan.header->image_id == ProgressJournal::imageId(FlashPages(chunks, bootattrs)));
+
+        SimulatedBootloader device(bootattrs);
+        Bootloader bootloader(device);
+        Flasher(bootloader, bootattrs).flashPlan(plan);
+        CHECK(device.memory == reference.memory);
+        CHECK(device.command_log == reference.command_log);
+
+        // the echoed unlock sequence is not part of the response, like on the normal path
+        SimulatedBootloader zeroing(bootattrs);
+        UnlockEchoConnection echo(zeroing);
+        Bootloader echo_bootloader(echo);
+        Flasher(echo_bootloader, bootattrs).flashPlan(plan);
+        CHECK(zeroing.memory == reference.memory);
+
+        // the checksum of the first chunk does not match once its data is damaged on the line
+        SimulatedBootloader damaged(bootattrs);
+        CorruptingConnection line(damaged);
+        Bootloader damaged_bootloader(line);
+        try
+        {
+            Flasher(damaged_bootloader, bootattrs).flashPlan(plan);
+            FAIL("the damaged chunk was not detected");
+        }
+        catch (const BootloaderError &error)
+        {
+            CHECK(error.code == ResponseCode::VERIFY_FAIL);
+        }
+        CHECK(damaged.command_log.size() == 3);
+
+        BootAttrs other = bootattrs;
+        other.device_id++;
+        SimulatedBootloader unused(bootattrs);
+        Bootloader unused_bootloader(unused);
+        CHECK_THROWS_AS(Flasher(unused_bootloader, other).flashPlan(plan), std::invalid_argument);
+        CHECK(unused.command_log.empty());
+    }
+
+    // a flipped byte anywhere in the file is caught before anything is sent
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(-20, std::ios::end);
+        file.put('X');
+    }
+    CHECK_THROWS_AS(FlashPlan plan(path), std::runtime_error);
+    CHECK_THROWS_AS(FlashPlan plan("/tmp/mcbootflash_missing.mcbp"), std::runtime_error);
+    unlink(path.c_str());
+}
+
+/// @brief keeps where the parts of every packet came from.
+class GatherRecordingConnection : public Connection
+{
+public:
+    SimulatedBootloader &device;
+    std::vector<std::vector<struct iovec>> packets;
+
+    explicit GatherRecordingConnection(SimulatedBootloader &device) : device(device) {}
+
+    void write(const uint8_t *data, size_t size) override { device.write(data, size); }
+    size_t read(uint8_t *data, size_t size, int timeout_ms) override { return device.read(data, size, timeout_ms); }
+    void writev(const struct iovec *parts, int count) override
+    {
+        packets.emplace_back(parts, parts + count);
+        Connection::writev(parts, count);
+    }
+};
+
+TEST_CASE("Bootloader sends WRITE_FLASH payloads straight from the image")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    SimulatedBootloader device(bootattrs);
+    GatherRecordingConnection connection(device);
+    Bootloader bootloader(connection);
+
+    Segment chunk(0x3000, 0x3000 + 240, testImageData(240, 1), 1);
+    bootloader.writeFlash(chunk);
+    bootloader.selfVerify();
+    REQUIRE(connection.packets.size() == 2);
+    REQUIRE(connection.packets[0].size() == 2);
+    CHECK(connection.packets[0][0].iov_len == Command::getSize());
+    CHECK(connection.packets[0][1].iov_base == chunk.data.data());
+    CHECK(connection.packets[0][1].iov_len == 240);
+    CHECK(connection.packets[1].size() == 1);
+    CHECK(std::equal(chunk.data.begin(), chunk.data.end(), device.at(chunk.address())));
+}
+
+TEST_CASE("Bootloader getBootAttrs skips the handshake for a cached device")
+{
+    BootAttrs expected = defaultBootAttrsForTest();
+    std::string path = "/tmp/mcbootflash_bootattrs";
+    unlink(path.c_str());
+
+    SimulatedBootloader device(expected);
+    Bootloader bootloader(device);
+    {
+        BootAttrsCache cache(path);
+        BootAttrs bootattrs = bootloader.getBootAttrs(cache, "/dev/ttyUSB0");
+        CHECK(bootattrs.memory_end == expected.memory_end);
+        CHECK(device.command_log.size() == 3);
+    }
+
+    // a new session : one READ_VERSION
+    BootAttrsCache cache(path);
+    device.command_log.clear();
+    BootAttrs bootattrs = bootloader.getBootAttrs(cache, "/dev/ttyUSB0");
+    CHECK(device.command_log == std::vector<unsigned int>{CommandCode::READ_VERSION});
+    CHECK(bootattrs.version == expected.version);
+    CHECK(bootattrs.max_packet_length == expected.max_packet_length);
+    CHECK(bootattrs.device_id == expected.device_id);
+    CHECK(bootattrs.erase_size == expected.erase_size);
+    CHECK(bootattrs.write_size == expected.write_size);
+    CHECK(bootattrs.memory_start == expected.memory_start);
+    CHECK(bootattrs.memory_end == expected.memory_end);
+    CHECK(bootattrs.has_checksum == expected.has_checksum);
+
+    // the same board on another port is not known there
+    device.command_log.clear();
+    bootloader.getBootAttrs(cache, "/dev/ttyUSB1");
+    CHECK(device.command_log.size() == 3);
+
+    // an updated bootloader is asked again
+    device.bootattrs.version++;
+    device.command_log.clear();
+    CHECK(bootloader.getBootAttrs(cache, "/dev/ttyUSB0").version == expected.version + 1);
+    CHECK(device.command_log.size() == 3);
+    CHECK(BootAttrsCache(path).entries.size() == 2);
+    unlink(path.c_str());
+}
+
+TEST_CASE("Device profiles prepare a flash plan before the device is attached")
+{
+    static_assert(findDeviceProfile(13398)->erase_size == 2048, "the PIC24 profile");
+    static_assert(findDeviceProfile(1) == nullptr, "no profile for an unknown part");
+    CHECK_THROWS_AS(deviceProfile(1), std::invalid_argument);
+
+    BootAttrs profile = deviceProfile(13398);
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("profile", testImageSegments()), profile);
+    std::string path = "/tmp/mcbootflash_profile.mcbp";
+    FlashPlan::compile(chunks, profile, path);
+
+    SimulatedBootloader device(defaultBootAttrsForTest());
+    Bootloader bootloader(device);
+    BootAttrs bootattrs = bootloader.getBootAttrs();
+    REQUIRE(matchesDeviceProfile(bootattrs));
+    {
+        FlashPlan plan(path);
+        Flasher(bootloader, bootattrs).flashPlan(plan);
+    }
+    unlink(path.c_str());
+
+    device.checksum_supported = false;
+    CHECK_FALSE(matchesDeviceProfile(bootloader.getBootAttrs()));
+}
+
+TEST_CASE("prepareImage parses the HEX file during the handshake")
+{
+    BootAttrs expected = defaultBootAttrsForTest();
+    std::string path = writeTestHexFile("prepare", testImageSegments());
+    SimulatedBootloader device(expected);
+    Bootloader bootloader(device);
+
+    PreparedImage prepared = prepareImage(path, [&]
+                                          {
+        usleep(20000); // a slow link
+        return bootloader.getBootAttrs(); });
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(path, expected);
+    REQUIRE(prepared.chunks.size() == chunks.size());
+    for (size_t i = 0; i < chunks.size(); i++)
+        CHECK(prepared.chunks[i] == chunks[i]);
+    CHECK(prepared.bootattrs.memory_end == expected.memory_end);
+    CHECK(prepared.handshake_ms >= 20);
+
+    CHECK_THROWS_AS(prepareImage("/tmp/mcbootflash_missing.hex", [&]
+                                 { return bootloader.getBootAttrs(); }),
+                    std::runtime_error);
+    CHECK_THROWS_WITH(prepareImage(path, []() -> BootAttrs
+                                   { throw BootloaderError("timeout while waiting for the bootloader", ResponseCode::UNSUPPORTED_COMMAND); }),
+                      "timeout while waiting for the bootloader");
+}
+
+TEST_CASE("Chunker gives the same chunks as the generic version")
+{
+    std::vector<uint8_t> padding{0, 0};
+
+    // aligned or not, short or spanning several chunks
+    for (unsigned int start : {0x3000u, 0x3002u, 0x3006u})
+    {
+        for (size_t length : {2u, 6u, 8u, 240u, 1000u, 1002u})
+        {
+            Segment segment(start, start + length, testImageData(length, start + length), 2);
+            for (const std::vector<uint8_t> &pad : {padding, std::vector<uint8_t>()})
+            {
+                if (pad.empty() && length < 8)
+                    continue; // the generic version needs a whole first write block without padding
+                std::vector<Segment> generic = segment.chunks(120, 4, pad);
+                std::vector<Segment> specialized;
+                Chunker<2, 8>::chunks(segment, 120, pad, specialized);
+                CHECK(specialized == generic);
+            }
+        }
+    }
+
+    // the second segment starts in the write block where the first one ends : their chunks are merged
+    HexFile hex;
+    REQUIRE(hex.load(writeTestHexFile("chunker", std::vector<Segment>{
+                                                     Segment(0x3000, 0x3004, testImageData(4, 1), 1),
+                                                     Segment(0x3006, 0x3200, testImageData(0x1FA, 2), 1),
+                                                     Segment(0x4000, 0x4010, testImageData(0x10, 3), 1),
+                                                 })));
+    std::vector<Segment> generic = hex.chunks(120, 4, padding);
+    CHECK(generic[1].minimum_address == generic[0].minimum_address);
+    CHECK(Chunker<2, 8>::chunks(hex.segments, 120, padding) == generic);
+    CHECK(Chunker<2, 4>::chunks(hex.segments, 120, padding) == hex.chunks(120, 2, padding));
+    typedef Chunker<2, 8> Pic24Chunker;
+    CHECK_THROWS_AS(Pic24Chunker::chunks(hex.segments, 121, padding), std::invalid_argument);
+
+    CHECK(chunkerFor(2, 8) != nullptr);
+    CHECK(chunkerFor(2, 6) == nullptr);
+}
+
+TEST_CASE("PackedImage keeps 3 bytes per instruction")
+{
+    BootAttrs bootattrs = defaultBootAttrsForTest();
+    HexFile hex;
+    std::vector<Segment> chunks = hex.chunked(writeTestHexFile("packed", testImageSegments()), bootattrs);
+    PackedImage image(chunks);
+    REQUIRE(image.size() == chunks.size());
+
+    size_t bytes = 0;
+    Segment chunk(0, 0, {}, 2);
+    for (size_t i = 0; i < chunks.size(); i++)
+    {
+        bytes += chunks[i].data.size();
+        image.expand(i, chunk);
+        CHECK(chunk == chunks[i]); // the test image has 0x00 phantom bytes
+        CHECK(image.checksum(i) == localChecksum(chunks[i].data));
+    }
+    CHECK(image.packedBytes() == bytes / 4 * 3);
+
+    SimulatedBootloader reference(bootattrs);
+    Bootloader reference_bootloader(reference);
+    Flasher(reference_bootloader, bootattrs).flash(chunks);
+    SimulatedBootloader device(bootattrs);
+    Bootloader bootloader(device);
+    Flasher(bootloader, bootattrs).flash(image);
+    CHECK(device.memory == reference.memory);
+
+    // the phantom byte does not exist in flash, it is not kept
+    std::vector<Segment> phantom{Segment(0x3000, 0x3008, {1, 2, 3, 0xAA, 4, 5, 6, 0xBB}, 2)};
+    PackedImage packed(phantom);
+    packed.expand(0, chunk);
+    CHECK(chunk.data == std::vector<uint8_t>{1, 2, 3, 0, 4, 5, 6, 0});
+    CHECK(packed.checksum(0) == localChecksum(phantom[0].data));
+    CHECK_THROWS_AS(PackedImage(std::vector<Segment>{Segment(0x3000, 0x3006, {1, 2, 3, 0, 4, 5}, 2)}), std::invalid_argument);
+}
+
+TEST_CASE("HexFile writes HEX records fast, with 02 or 04 extended addresses")
+{
+    std::vector<uint8_t> all(256);
+    for (unsigned int i = 0; i < all.size(); i++)
+        all[i] = i;
+    std::string encoded(2 * all.size(), ' ');
+    for (size_t size : {256u, 7u, 1u})
+    {
+        encodeHex(all.data(), size, &encoded[0]);
+        for (unsigned int i = 0; i < size; i++)
+        {
+            char expected[3];
+            snprintf(expected, sizeof(expected), "%02X", (unsigned int)all[i]);
+            CHECK(encoded.compare(2 * i, 2, expected) == 0);
+        }
+    }
+
+    HexFile hex;
+    hex.add_binary(std::vector<uint8_t>{0x01, 0x02, 0x03, 0x04}, 0x1fffe);
+    CHECK(hex.as_ihex(32, 24) == ":020000021000EC\n"
+                                 ":02FFFE000102FE\n"
+                                 ":020000022000DC\n"
+                                 ":020000000304F7\n"
+                                 ":00000001FF\n");
+    CHECK_THROWS_AS(hex.as_ihex(32, 16), std::runtime_error);
+    CHECK_THROWS_AS(hex.as_ihex(0), std::invalid_argument);
+    CHECK_THROWS_AS(hex.as_ihex(32, 20), std::invalid_argument);
+
+    // records which do not divide 64 KiB are split where the offset of 02 records wraps
+    HexFile crossing;
+    crossing.add_binary(testImageData(0x200, 3), 0xff00);
+    std::string records = crossing.as_ihex(255, 24);
+    std::istringstream lines(records);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        unsigned int type_, address, size;
+        std::vector<uint8_t> data;
+        crossing.unpack_ihex(line, type_, address, size, data);
+        if (type_ == IHEX_DATA)
+            CHECK(address + size <= 0x10000);
+    }
+    CHECK(records.find(":01FFFF00") != std::string::npos);
+    CHECK(records.find(":020000021000EC") != std::string::npos);
+    std::string crossing_path = "/tmp/mcbootflash_crossing.hex";
+    crossing.save_ihex(crossing_path, 255, 24);
+    HexFile reloaded;
+    REQUIRE(reloaded.load(crossing_path));
+    CHECK(reloaded.as_binary() == crossing.as_binary());
+    unlink(crossing_path.c_str());
+    CHECK_THROWS_AS(crossing.as_ihex(255, 16), std::runtime_error);
+
+    // any record length, round trip through a file written in place
+    HexFile image;
+    for (const Segment &segment : testImageSegments())
+        image.add_binary(segment.data, segment.minimum_address);
+    for (unsigned int record : {16u, 24u, 32u, 255u})
+    {
+        std::string text = image.as_ihex(record);
+        CHECK(text.size() == image.ihex_size(record));
+        std::string path = "/tmp/mcbootflash_save_" + std::to_string(record) + ".hex";
+        image.save_ihex(path, record);
+        std::ifstream file(path);
+        std::string saved((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        CHECK(saved == text);
+
+        HexFile loaded;
+        REQUIRE(loaded.load(path));
+        CHECK(loaded.as_binary() == image.as_binary());
+        unlink(path.c_str());
+    }
+}
+
+TEST_CASE("HexFile::merge combines images with an overlap policy")
+{
+    HexFile bootloader, application, configuration;
+    bootloader.add_binary(std::vector<uint8_t>(0x100, 0xb0), 0);
+    application.add_binary(std::vector<uint8_t>(0x2000, 0xa0), 0x3000);
+    configuration.add_binary(std::vector<uint8_t>(0x200, 0xc0), 0x4f00);
+    std::vector<const HexFile *> files{&bootloader, &application, &configuration};
+
+    CHECK_THROWS_AS(HexFile::merge(files), std::runtime_error);
+
+    HexFile first = HexFile::merge(files, MERGE_FIRST_WINS);
+    REQUIRE(first.segments.size() == 2);
+    CHECK(first.segments[0].minimum_address == 0);
+    CHECK(first.segments[0].maximum_address == 0x100);
+    CHECK(first.segments[1].minimum_address == 0x3000);
+    CHECK(first.segments[1].maximum_address == 0x5100);
+    CHECK(first.segments[1].data[0x4eff - 0x3000] == 0xa0);
+    CHECK(first.segments[1].data[0x4fff - 0x3000] == 0xa0);
+    CHECK(first.segments[1].data[0x5000 - 0x3000] == 0xc0);
+
+    HexFile last = HexFile::merge(files, MERGE_LAST_WINS);
+    REQUIRE(last.segments.size() == 2);
+    CHECK(last.segments[1].data[0x4eff - 0x3000] == 0xa0);
+    CHECK(last.segments[1].data[0x4f00 - 0x3000] == 0xc0);
+
+    // same result as adding the files one after the other, when they do not overlap
+    HexFile separate;
+    separate.add_binary(std::vector<uint8_t>(0x100, 0xd0), 0x100);
+    HexFile merged = HexFile::merge({&separate, &bootloader, &application});
+    HexFile added;
+    added.add_binary(std::vector<uint8_t>(0x100, 0xb0), 0);
+    added.add_binary(std::vector<uint8_t>(0x100, 0xd0), 0x100);
+    added.add_binary(std::vector<uint8_t>(0x2000, 0xa0), 0x3000);
+    REQUIRE(merged.segments.size() == 2);
+    CHECK(merged.as_binary() == added.as_binary());
+    CHECK(merged.as_ihex() == added.as_ihex());
+
+    // the result can still grow
+    merged.add_binary(std::vector<uint8_t>{1, 2}, 0x5000);
+    CHECK(merged.segments.size() == 2);
+    CHECK(merged.segments[1].maximum_address == 0x5002);
+}
+
+TEST_CASE("PatchedImage changes a few bytes of a shared image for one device")
+{
+    std::vector<Segment> chunks{Segment(0x3000, 0x3008, {1, 2, 3, 0, 4, 5, 6, 0}, 2),
+                                Segment(0x3008, 0x3010, {7, 8, 9, 0, 10, 11, 12, 0}, 2),
+                                Segment(0x4000, 0x4008, {13, 14, 15, 0, 16, 17, 18, 0}, 2)};
+    PatchedImage image(std::make_shared<const std::vector<Segment>>(chunks));
+
+    // a serial number across the first two chunks; the shared image and the other copies do not see it
+    PatchedImage device = image;
+    PatchedImage other = image;
+    device.patch(0x3004, {0x12, 0x34, 0x56, 0x00, 0x78, 0x9a});
+    CHECK(device.patchedChunks() == 2);
+    CHECK(image.patchedChunks() == 0);
+    CHECK(other.patchedChunks() == 0);
+
+    Segment chunk(0, 0, {}, 2);
+    device.expand(0, chunk);
+    CHECK(chunk.data == std::vector<uint8_t>{1, 2, 3, 0, 0x12, 0x34, 0x56, 0});
+    CHECK(device.checksum(0) == localChecksum(chunk.data));
+    device.expand(1, chunk);
+    CHECK(chunk.data == std::vector<uint8_t>{0x78, 0x9a, 9, 0, 10, 11, 12, 0});
+    CHECK(device.checksum(1) == localChecksum(chunk.data));
+    CHECK(device.checksum(2) == localChecksum(chunks[2].data));
+    image.expand(0, chunk);
+    CHECK(chunk == chunks[0]);
+    CHECK(image.checksum(0) == localChecksum(chunks[0].data));
+
+    // a patch cannot add data, and a failed one changes nothing
+    CHECK_THROWS_AS(device.patch(0x400c, {1, 2, 3, 4, 5}), std::invalid_argument);
+    CHECK_THROWS_AS(device.patch(0x300e, {1, 2, 3}), std::invalid_argument); // runs into the gap
+    CHECK_THROWS_AS(device.patch(0, {1}), std::invalid_argument);
+    CHECK(device.patchedChunks() == 2);
+    device.expand(2, chunk);
+    CHECK(chunk == chunks[2]);
+}
+
+TEST_CASE("HexFile::read fills the gaps between segments with padding")
+{
+    HexFile hex;
+    hex.add_binary(std::vector<uint8_t>{1, 2, 3, 4}, 0x10);
+    hex.add_binary(std::vector<uint8_t>{5, 6}, 0x18);
+    hex.add_binary(std::vector<uint8_t>{7, 8, 9, 10}, 0x100);
+
+    std::vector<uint8_t> out(12);
+    CHECK(hex.read(0x0e, 12, out.data()) == 6);
+    CHECK(out == std::vector<uint8_t>{0xff, 0xff, 1, 2, 3, 4, 0xff, 0xff, 0xff, 0xff, 5, 6});
+    CHECK(hex.read(0x12, 4, out.data(), 0) == 2);
+    CHECK(std::vector<uint8_t>(out.begin(), out.begin() + 4) == std::vector<uint8_t>{3, 4, 0, 0});
+    CHECK(hex.read(0x20, 8, out.data()) == 0);
+    CHECK(std::vector<uint8_t>(out.begin(), out.begin() + 8) == std::vector<uint8_t>(8, 0xff));
+    CHECK(hex.read(0x102, 0, out.data()) == 0);
+
+    const uint8_t *inside = hex.view(0x101, 3);
+    REQUIRE(inside != nullptr);
+    CHECK(inside[0] == 8);
+    CHECK(inside[2] == 10);
+    CHECK(hex.view(0x12, 4) == nullptr); // across a gap
+    CHECK(hex.view(0x0f, 2) == nullptr);
+    CHECK(hex.view(0x200, 1) == nullptr);
+
+    // the same bytes as the whole image, at any offset
+    HexFile image;
+    for (const Segment &segment : testImageSegments())
+        image.add_binary(segment.data, segment.minimum_address);
+    std::vector<uint8_t> binary = image.as_binary();
+    unsigned int start = image.segments.front().minimum_address;
+    std::vector<uint8_t> part(300);
+    for (size_t offset = 0; offset + part.size() <= binary.size(); offset += 997)
+    {
+        image.read(start + offset, part.size(), part.data());
+        CHECK(std::equal(part.begin(), part.end(), binary.begin() + offset));
+    }
+}
@@ -0,0 +1,127 @@
+#include "uring.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+IoUring::IoUring(unsigned entries)
+    : fd(-1), sq_ring(MAP_FAILED), sq_ring_size(0), cq_ring(MAP_FAILED), cq_ring_size(0),
+      sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), sqes_size(0), queued(0)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+    {
+        throw std::runtime_error(std::string("io_uring_setup failed: ") + strerror(errno));
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = static_cast<struct io_uring_sqe *>(
+        mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        std::string reason = strerror(errno);
+        release();
+        throw std::runtime_error("cannot map io_uring rings: " + reason);
+    }
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring()
+{
+    release();
+}
+
+void IoUring::release()
+{
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if (cq_ring != MAP_FAILED)
+        munmap(cq_ring, cq_ring_size);
+    if (sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+    if (fd >= 0)
+        ::close(fd);
+    sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    cq_ring = MAP_FAILED;
+    sq_ring = MAP_FAILED;
+    fd = -1;
+}
+
+bool IoUring::available()
+{
+    try
+    {
+        IoUring ring(2);
+        return true;
+    }
+    catch (const std::runtime_error &)
+    {
+        return false;
+    }
+}
+
+struct io_uring_sqe *IoUring::getSqe()
+{
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *sq_tail + queued;
+    if (tail - head > *sq_mask)
+        return nullptr;
+
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[index] = index;
+    queued++;
+    return sqe;
+}
+
+void IoUring::submitAndWait(unsigned wait)
+{
+    unsigned submit = queued;
+    __atomic_store_n(sq_tail, *sq_tail + queued, __ATOMIC_RELEASE);
+    queued = 0;
+
+    while (true)
+    {
+        int ret = (int)syscall(__NR_io_uring_enter, fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+        if (ret >= 0)
+            return;
+        if (errno != EINTR)
+            throw std::runtime_error(std::string("io_uring_enter failed: ") + strerror(errno));
+        // the entries were consumed before the signal, only wait again
+        submit = 0;
+    }
+}
+
+bool IoUring::popCqe(struct io_uring_cqe &cqe)
+{
+    unsigned head = *cq_head;
+    if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        return false;
+    cqe = cqes[head & *cq_mask];
+    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef URING_H
+#define URING_H
+
+#include <cstddef>
+#include <linux/io_uring.h>
+
+/// @brief Just enough of io_uring for the fleet flasher, on top of the raw system calls (no liburing).
+class IoUring
+{
+private:
+    int fd;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    unsigned queued; // sqes filled since the last submit
+
+    void release();
+
+public:
+    /// @brief throws std::runtime_error if the kernel does not provide io_uring (or forbids it).
+    explicit IoUring(unsigned entries);
+    ~IoUring();
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    static bool available();
+
+    /// @brief next free submission entry, cleared, or nullptr if the submission queue is full.
+    struct io_uring_sqe *getSqe();
+    /// @brief submits every queued entry and waits for at least `wait` completions, in a single system call.
+    void submitAndWait(unsigned wait);
+    /// @brief pops one completion, returns false if there is none.
+    bool popCqe(struct io_uring_cqe &cqe);
+};
+
+#endif /* URING_H */